@@ -0,0 +1,840 @@
+/**
+ * @file   bench_mm.c
+ * @brief  Micro benchmarks for the memory management sub system.
+ *
+ * Run without arguments to run every benchmark, or give the names of the
+ * benchmarks to run.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include "mm.h"
+
+#define MAX_LIVE_BLOCKS (64 * 1024)
+
+static void *ptrs[MAX_LIVE_BLOCKS];
+
+/* Monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**
+ * @name   Free latency benchmark
+ * @brief  Average cost of simple_free as the number of live blocks grows.
+ *
+ * Every other block is freed first (no neighbour is free), then the rest
+ * (both neighbours are free), so both the plain and the coalescing path
+ * are measured. The cost per free should not depend on the number of
+ * live blocks.
+ */
+static void bench_free_latency(void) {
+  size_t live;
+
+  printf("%-12s %16s %16s\n", "live blocks", "ns/free isolated", "ns/free merging");
+
+  for (live = 1024; live <= MAX_LIVE_BLOCKS; live *= 4) {
+    size_t n;
+    uint64_t t0, t1, t2;
+
+    for (n = 0; n < live; n++) {
+      ptrs[n] = simple_malloc(64);
+      if (ptrs[n] == NULL) {
+        printf("Allocation failed at %zu blocks\n", n);
+        return;
+      }
+    }
+
+    t0 = now_ns();
+    for (n = 0; n < live; n += 2) simple_free(ptrs[n]);
+    t1 = now_ns();
+    for (n = 1; n < live; n += 2) simple_free(ptrs[n]);
+    t2 = now_ns();
+
+    printf("%-12zu %16.1f %16.1f\n", live,
+           (double) (t1 - t0) / (live / 2), (double) (t2 - t1) / (live / 2));
+  }
+}
+
+/**
+ * @name   Fragmented allocation benchmark
+ * @brief  Average cost of simple_malloc when the arena is full of small holes.
+ *
+ * Small blocks are interleaved with pinned blocks and then freed, leaving
+ * holes that are too small for the requests that follow. A heap walk would
+ * have to step over every hole; a size class lookup does not see them.
+ */
+static void bench_fragmented_malloc(void) {
+  size_t live;
+
+  printf("%-12s %16s\n", "holes", "ns/malloc");
+
+  for (live = 1024; live <= MAX_LIVE_BLOCKS / 2; live *= 4) {
+    void *big[256];
+    size_t n;
+    uint64_t t0, t1;
+
+    for (n = 0; n < 2 * live; n++) {
+      ptrs[n] = simple_malloc(n & 1 ? 64 : 24);
+      if (ptrs[n] == NULL) {
+        printf("Allocation failed at %zu blocks\n", n);
+        return;
+      }
+    }
+    for (n = 0; n < 2 * live; n += 2) simple_free(ptrs[n]);
+
+    t0 = now_ns();
+    for (n = 0; n < 256; n++) big[n] = simple_malloc(128);
+    t1 = now_ns();
+
+    for (n = 0; n < 256; n++) simple_free(big[n]);
+    for (n = 1; n < 2 * live; n += 2) simple_free(ptrs[n]);
+
+    printf("%-12zu %16.1f\n", live, (double) (t1 - t0) / 256);
+  }
+}
+
+/**
+ * @name   Large mixed allocation benchmark
+ * @brief  Cost of large requests and peak footprint under mixed sizes, with
+ *         huge requests in the heap and in mappings of their own.
+ *
+ * Like test_memory_exerciser, blocks of a few KB up to a few MB are kept
+ * live in 16 round robin slots. The footprint is the highest address any
+ * block in the static memory reached, measured from memory_start.
+ */
+static void bench_large_mixed(void) {
+  static const long thresholds[] = { 0, 1024 * 1024 };
+  size_t t;
+
+  printf("%-10s %8s %12s %12s %10s\n", "mmap", "mallocs", "ns/malloc", "ns/free", "peak MB");
+  for (t = 0; t < 2; t++) {
+    void *slot[16] = { NULL };
+    size_t slot_size[16] = { 0 };
+    size_t live_bytes = 0;
+    uintptr_t peak = memory_start;
+    uint64_t malloc_ns = 0, free_ns = 0;
+    size_t mallocs = 0, frees = 0;
+    size_t n;
+
+    simple_mallopt(MM_OPT_MMAP_THRESHOLD, thresholds[t]);
+    srand(1);
+    for (n = 0; n < 20000; n++) {
+      size_t i = n & 15;
+      size_t size = 4096 + (size_t) rand() % (2 * 1024 * 1024);
+      uint64_t t0;
+
+      if (slot[i] != NULL) {
+        t0 = now_ns();
+        simple_free(slot[i]);
+        free_ns += now_ns() - t0;
+        frees++;
+        live_bytes -= slot_size[i];
+        slot[i] = NULL;
+      }
+      if (live_bytes + size > 12 * 1024 * 1024) continue;
+
+      t0 = now_ns();
+      slot[i] = simple_malloc(size);
+      malloc_ns += now_ns() - t0;
+      mallocs++;
+
+      if (slot[i] == NULL) {
+        printf("Allocation of %zu bytes failed with %zu bytes live\n", size, live_bytes);
+        continue;
+      }
+      slot_size[i] = size;
+      live_bytes += size;
+      if ((uintptr_t) slot[i] >= memory_start && (uintptr_t) slot[i] < memory_end &&
+          (uintptr_t) slot[i] + size > peak) {
+        peak = (uintptr_t) slot[i] + size;
+      }
+    }
+    for (n = 0; n < 16; n++) simple_free(slot[n]);
+
+    printf("%-10s %8zu %12.1f %12.1f %10.2f\n", thresholds[t] ? ">= 1 MB" : "off", mallocs,
+           (double) malloc_ns / mallocs, (double) free_ns / frees,
+           (double) (peak - memory_start) / (1024 * 1024));
+  }
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024);
+}
+
+#define CALLOC_BUFFERS 8
+#define CALLOC_SIZE    (2 * 1024 * 1024)
+
+/**
+ * @name   Calloc benchmark
+ * @brief  Cost of large zeroed buffers on first use and once recycled.
+ *
+ * Run it on its own (./mm_bench calloc) for the first round to get memory
+ * that was never handed out, which simple_calloc does not clear again. The
+ * buffers are kept off the mmap path, which always gets fresh pages.
+ */
+static void bench_calloc(void) {
+  void *buffers[CALLOC_BUFFERS];
+  int round, n;
+
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 0);
+  for (round = 0; round < 2; round++) {
+    uint64_t t0 = now_ns();
+
+    for (n = 0; n < CALLOC_BUFFERS; n++) buffers[n] = simple_calloc(1, CALLOC_SIZE);
+    uint64_t ns = now_ns() - t0;
+    for (n = 0; n < CALLOC_BUFFERS; n++) {
+      memset(buffers[n], 0xAA, CALLOC_SIZE);
+      simple_free(buffers[n]);
+    }
+
+    printf("%-9s %d x %d KB in %8.1f us\n", round ? "recycled" : "first", CALLOC_BUFFERS,
+           CALLOC_SIZE / 1024, (double) ns / 1000);
+  }
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024);
+}
+
+#define POOL_OPS (1000000)
+
+/**
+ * @name   Pool benchmark
+ * @brief  Fixed size objects from a pool against simple_malloc.
+ *
+ * Objects of a few struct sizes are kept live in a window of 4096 and
+ * replaced in random order.
+ */
+static void bench_pool(void) {
+  static const size_t sizes[] = { 24, 48, 72, 200 };
+  size_t s, n;
+
+  printf("%-6s %14s %14s\n", "size", "malloc ops/s", "pool ops/s");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    SimplePool *pool = simple_pool_create(sizes[s]);
+    uint64_t t0, malloc_ns, pool_ns;
+
+    memset(ptrs, 0, 4096 * sizeof(void *));
+    srand(1);
+    t0 = now_ns();
+    for (n = 0; n < POOL_OPS; n++) {
+      size_t i = (size_t) rand() & 4095;
+      simple_free(ptrs[i]);
+      ptrs[i] = simple_malloc(sizes[s]);
+    }
+    for (n = 0; n < 4096; n++) simple_free(ptrs[n]);
+    malloc_ns = now_ns() - t0;
+
+    memset(ptrs, 0, 4096 * sizeof(void *));
+    srand(1);
+    t0 = now_ns();
+    for (n = 0; n < POOL_OPS; n++) {
+      size_t i = (size_t) rand() & 4095;
+      simple_pool_free(pool, ptrs[i]);
+      ptrs[i] = simple_pool_alloc(pool);
+    }
+    for (n = 0; n < 4096; n++) simple_pool_free(pool, ptrs[n]);
+    pool_ns = now_ns() - t0;
+    simple_pool_destroy(pool);
+
+    printf("%-6zu %14.0f %14.0f\n", sizes[s], POOL_OPS * 1e9 / malloc_ns, POOL_OPS * 1e9 / pool_ns);
+  }
+}
+
+#define REGION_REQUESTS (2000)
+#define REGION_OBJECTS  (4000)
+
+/**
+ * @name   Region benchmark
+ * @brief  Request scoped objects released by a region reset against one
+ *         simple_free per object.
+ *
+ * Every request allocates a few thousand small objects of mixed sizes and
+ * releases all of them at its end.
+ */
+static void bench_region(void) {
+  SimpleRegion *region = simple_region_create();
+  uint64_t t0, free_ns, region_ns;
+  size_t r, n;
+
+  t0 = now_ns();
+  for (r = 0; r < REGION_REQUESTS; r++) {
+    for (n = 0; n < REGION_OBJECTS; n++) ptrs[n] = simple_malloc(16 + (n * 37) % 300);
+    for (n = 0; n < REGION_OBJECTS; n++) simple_free(ptrs[n]);
+  }
+  free_ns = now_ns() - t0;
+
+  t0 = now_ns();
+  for (r = 0; r < REGION_REQUESTS; r++) {
+    for (n = 0; n < REGION_OBJECTS; n++) ptrs[n] = simple_region_alloc(region, 16 + (n * 37) % 300);
+    simple_region_reset(region);
+  }
+  region_ns = now_ns() - t0;
+  simple_region_destroy(region);
+
+  printf("%-14s %10.1f us/request\n", "simple_free", (double) free_ns / REGION_REQUESTS / 1000);
+  printf("%-14s %10.1f us/request\n", "region reset", (double) region_ns / REGION_REQUESTS / 1000);
+}
+
+#define BATCH_ROUNDS  (2000)
+#define BATCH_OBJECTS (4000)
+
+/**
+ * @name   Batch benchmark
+ * @brief  Objects allocated and freed together through the batch calls against
+ *         one simple_malloc and simple_free per object.
+ */
+static void bench_batch(void) {
+  uint64_t t0, single_ns, batch_ns;
+  size_t r, n;
+
+  t0 = now_ns();
+  for (r = 0; r < BATCH_ROUNDS; r++) {
+    for (n = 0; n < BATCH_OBJECTS; n++) ptrs[n] = simple_malloc(48);
+    for (n = 0; n < BATCH_OBJECTS; n++) simple_free(ptrs[n]);
+  }
+  single_ns = now_ns() - t0;
+
+  t0 = now_ns();
+  for (r = 0; r < BATCH_ROUNDS; r++) {
+    n = simple_malloc_batch(48, BATCH_OBJECTS, ptrs);
+    simple_free_batch(ptrs, n);
+  }
+  batch_ns = now_ns() - t0;
+
+  printf("%-14s %10.1f us/round\n", "one by one", (double) single_ns / BATCH_ROUNDS / 1000);
+  printf("%-14s %10.1f us/round\n", "batch", (double) batch_ns / BATCH_ROUNDS / 1000);
+}
+
+#define PERSIST_NODES (200000)
+
+/* Node of the table rebuilt or reopened by the persist benchmark */
+typedef struct {
+  uint64_t next;
+  uint64_t key;
+  char value[40];
+} BenchNode;
+
+/**
+ * @name   Persist benchmark
+ * @brief  Startup with a table of nodes rebuilt in memory against reopening
+ *         it from a persistent heap and walking it.
+ */
+static void bench_persist(void) {
+  char path[] = "/tmp/mm_bench_persistXXXXXX";
+  int fd = mkstemp(path);
+  SimplePersist *heap;
+  BenchNode *node, *head = NULL;
+  uint64_t t0, rebuild_ns, reopen_ns, sum = 0;
+  size_t n;
+
+  if (fd < 0) {
+    printf("no temporary file\n");
+    return;
+  }
+  close(fd);
+
+  t0 = now_ns();
+  for (n = 0; n < PERSIST_NODES; n++) {
+    node = simple_malloc(sizeof(BenchNode));
+    node->key = n * 2654435761u;
+    snprintf(node->value, sizeof(node->value), "value %zu", n);
+    node->next = (uintptr_t) head;
+    head = node;
+  }
+  rebuild_ns = now_ns() - t0;
+  while (head != NULL) {
+    node = (BenchNode *) (uintptr_t) head->next;
+    simple_free(head);
+    head = node;
+  }
+
+  heap = simple_persist_open(path, PERSIST_NODES * (sizeof(BenchNode) + 16) + 4096);
+  for (n = 0; n < PERSIST_NODES; n++) {
+    node = simple_persist_alloc(heap, sizeof(BenchNode));
+    node->key = n * 2654435761u;
+    snprintf(node->value, sizeof(node->value), "value %zu", n);
+    node->next = simple_persist_offset(heap, head);
+    head = node;
+  }
+  simple_persist_set_root(heap, "table", head);
+  simple_persist_close(heap);
+
+  t0 = now_ns();
+  heap = simple_persist_open(path, 0);
+  for (node = simple_persist_root(heap, "table"); node != NULL; node = simple_persist_pointer(heap, node->next)) {
+    sum += node->key;
+  }
+  reopen_ns = now_ns() - t0;
+  simple_persist_close(heap);
+  unlink(path);
+
+  printf("%-14s %10.1f ms\n", "rebuild", (double) rebuild_ns / 1e6);
+  printf("%-14s %10.1f ms (checksum %llx)\n", "reopen + walk", (double) reopen_ns / 1e6, (unsigned long long) sum);
+}
+
+/* Resident memory of the process in MB, or -1 if unknown */
+static double resident_mb(void) {
+  long pages = -1, resident = -1;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (f == NULL) return -1;
+  if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+  fclose(f);
+  return resident < 0 ? -1 : (double) resident * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/**
+ * @name   Trim benchmark
+ * @brief  Resident memory after a spike, left to the lazy threshold and after simple_trim.
+ */
+static void bench_trim(void) {
+  size_t n, count = 0;
+  uint64_t t0;
+
+  printf("%-12s %8.1f MB\n", "before", resident_mb());
+  for (n = 0; n < 96; n++) {
+    ptrs[n] = simple_malloc(256 * 1024);
+    if (ptrs[n] == NULL) break;
+    memset(ptrs[n], 1, 256 * 1024);
+    count++;
+  }
+  printf("%-12s %8.1f MB\n", "spike", resident_mb());
+
+  for (n = 0; n < count; n++) simple_free(ptrs[n]);
+  printf("%-12s %8.1f MB\n", "freed", resident_mb());
+
+  t0 = now_ns();
+  simple_trim();
+  printf("%-12s %8.1f MB in %.1f us\n", "simple_trim", resident_mb(), (double) (now_ns() - t0) / 1000);
+}
+
+/* Opens a counter of the data TLB misses of the calling thread, or returns -1 */
+static int open_dtlb_counter(void) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#define HUGE_WALK_OPS (20000)
+
+/* Next-fit churn over a heap full of holes, in a fresh process per mode */
+static void huge_pages_walk(int mode, const char *name) {
+  int counter = open_dtlb_counter();
+  long long misses = 0;
+  size_t live = 0, n;
+  uint64_t t0;
+
+  simple_mallopt(MM_OPT_HUGE_PAGES, mode);
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_NEXT_FIT);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+
+  // Spread blocks over most of the static memory, then free every other one
+  srand(1);
+  while (live < MAX_LIVE_BLOCKS && (ptrs[live] = simple_malloc(64 + (size_t) rand() % 2048)) != NULL &&
+         (uintptr_t) ptrs[live] < memory_end - 4 * 1024 * 1024) {
+    live++;
+  }
+  for (n = 0; n < live; n += 2) {
+    simple_free(ptrs[n]);
+    ptrs[n] = NULL;
+  }
+
+  if (counter >= 0) ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  t0 = now_ns();
+  for (n = 0; n < HUGE_WALK_OPS; n++) {
+    size_t i = (size_t) rand() % live;
+    simple_free(ptrs[i]);
+    ptrs[i] = simple_malloc(64 + (size_t) rand() % 3000);
+  }
+  uint64_t ns = now_ns() - t0;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+    close(counter);
+  }
+
+  printf("%-8s %14.0f ", name, HUGE_WALK_OPS * 1e9 / ns);
+  if (counter >= 0 && misses >= 0) {
+    printf("%14lld\n", misses);
+  } else {
+    printf("%14s\n", "n/a");
+  }
+}
+
+/**
+ * @name   Huge page benchmark
+ * @brief  Throughput and data TLB misses of next-fit walks, with and without
+ *         huge pages. TLB misses show n/a where perf events are not allowed.
+ */
+static void bench_huge_pages(void) {
+  static const struct { int mode; const char *name; } modes[] = {
+    { MM_HUGE_PAGES_OFF, "off" },
+    { MM_HUGE_PAGES_THP, "thp" },
+    { MM_HUGE_PAGES_HUGETLB, "hugetlb" },
+  };
+  size_t m;
+
+  printf("%-8s %14s %14s\n", "pages", "ops/s", "dTLB misses");
+  for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      // The mode has to be set before the heap is first touched
+      huge_pages_walk(modes[m].mode, modes[m].name);
+      fflush(stdout);
+      _exit(0);
+    }
+    if (pid > 0) waitpid(pid, NULL, 0);
+  }
+}
+
+#define SMALL_OBJECTS (50000)
+
+/* Allocates small objects in a fresh process and reports the heap they span */
+static void small_objects_run(size_t size, int small_pages) {
+  uintptr_t low = UINTPTR_MAX, high = 0;
+  uint64_t t0;
+  size_t n;
+
+  simple_mallopt(MM_OPT_SMALL_PAGES, small_pages);
+  t0 = now_ns();
+  for (n = 0; n < SMALL_OBJECTS; n++) {
+    ptrs[n] = simple_malloc(size);
+  }
+  uint64_t ns = now_ns() - t0;
+
+  for (n = 0; n < SMALL_OBJECTS; n++) {
+    if ((uintptr_t) ptrs[n] < low) low = (uintptr_t) ptrs[n];
+    if ((uintptr_t) ptrs[n] + size > high) high = (uintptr_t) ptrs[n] + size;
+  }
+  printf("%-6zu %-6s %12.1f %12.1f\n", size, small_pages ? "on" : "off",
+         (double) (high - low) / SMALL_OBJECTS, (double) ns / SMALL_OBJECTS);
+}
+
+/**
+ * @name   Small object benchmark
+ * @brief  Bytes of heap and time per small object, with and without the
+ *         headerless small object spans.
+ */
+static void bench_small_objects(void) {
+  static const size_t sizes[] = { 8, 16, 32, 64 };
+  size_t s;
+  int on;
+
+  printf("%-6s %-6s %12s %12s\n", "size", "spans", "bytes/obj", "ns/malloc");
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    for (on = 0; on < 2; on++) {
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0) {
+        small_objects_run(sizes[s], on);
+        fflush(stdout);
+        _exit(0);
+      }
+      if (pid > 0) waitpid(pid, NULL, 0);
+    }
+  }
+}
+
+/* Random alloc/free workload, shared by the policy comparison */
+typedef struct {
+  const char *name;
+  size_t slots;        /* Blocks kept live in round robin slots */
+  size_t min_size;
+  size_t max_size;
+  size_t ops;
+} Workload;
+
+typedef struct {
+  double ops_per_sec;
+  uint64_t worst_ns;   /* Slowest single simple_malloc */
+  double frag;         /* Share of the footprint not live at the peak */
+  size_t failed;
+} WorkloadResult;
+
+static WorkloadResult run_workload(const Workload *w) {
+  static size_t slot_size[MAX_LIVE_BLOCKS];
+  WorkloadResult r = { 0, 0, 0, 0 };
+  size_t live_bytes = 0;
+  size_t peak_live = 0;
+  size_t peak_footprint = 0;
+  uint64_t start, t0, t1, measure_ns = 0;
+  size_t n;
+
+  memset(ptrs, 0, w->slots * sizeof(void *));
+  srand(7);
+  start = now_ns();
+  for (n = 0; n < w->ops; n++) {
+    size_t i = (size_t) rand() % w->slots;
+    size_t size = w->min_size + (size_t) rand() % (w->max_size - w->min_size + 1);
+
+    if (ptrs[i] != NULL) {
+      simple_free(ptrs[i]);
+      live_bytes -= slot_size[i];
+    }
+
+    t0 = now_ns();
+    ptrs[i] = simple_malloc(size);
+    t1 = now_ns();
+    if (t1 - t0 > r.worst_ns) r.worst_ns = t1 - t0;
+
+    if (ptrs[i] == NULL) {
+      r.failed++;
+      continue;
+    }
+    slot_size[i] = size;
+    live_bytes += size;
+    // The heap walk is left out of the throughput
+    if (live_bytes > peak_live) {
+      t0 = now_ns();
+      peak_live = live_bytes;
+      peak_footprint = simple_heap_footprint();
+      measure_ns += now_ns() - t0;
+    }
+  }
+  r.ops_per_sec = (double) w->ops * 1e9 / (double) (now_ns() - start - measure_ns);
+  r.frag = 1.0 - (double) peak_live / (double) peak_footprint;
+
+  for (n = 0; n < w->slots; n++) simple_free(ptrs[n]);
+  return r;
+}
+
+/**
+ * @name   Placement policy comparison
+ * @brief  Throughput, worst case latency and fragmentation of every policy
+ *         on the same workloads.
+ */
+static void bench_policies(void) {
+  static const Workload workloads[] = {
+    { "small",  8192,  16,   512,             100000 },
+    { "mixed",  1024,  16,   32 * 1024,       50000 },
+    { "large",  16,    4096, 2 * 1024 * 1024, 20000 },
+  };
+  static const struct { const char *name; int policy; } policies[] = {
+    { "first-fit", MM_POLICY_FIRST_FIT },
+    { "next-fit",  MM_POLICY_NEXT_FIT },
+    { "best-fit",  MM_POLICY_BEST_FIT },
+    { "tlsf",      MM_POLICY_TLSF },
+  };
+  size_t w, p;
+
+  // Large blocks must stay in the heap for the policies to place them, and no
+  // block may reach the next policy through the thread cache
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  printf("%-8s %-10s %14s %12s %8s %8s\n", "workload", "policy", "ops/s", "worst ns", "frag", "failed");
+  for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+      WorkloadResult r;
+
+      simple_mallopt(MM_OPT_POLICY, policies[p].policy);
+      r = run_workload(&workloads[w]);
+      printf("%-8s %-10s %14.0f %12llu %7.1f%% %8zu\n", workloads[w].name, policies[p].name,
+             r.ops_per_sec, (unsigned long long) r.worst_ns, 100.0 * r.frag, r.failed);
+    }
+  }
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_BEST_FIT);
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+
+#define THREAD_OPS (200000)
+
+/* Worker for the scalability benchmark: small blocks in a window of 64 */
+static void *thread_churn(void *arg) {
+  unsigned int seed = (unsigned int) (uintptr_t) arg;
+  void *window[64] = { NULL };
+  size_t n;
+
+  for (n = 0; n < THREAD_OPS; n++) {
+    size_t i = n & 63;
+    simple_free(window[i]);
+    window[i] = simple_malloc(16 + rand_r(&seed) % 240);
+  }
+  for (n = 0; n < 64; n++) simple_free(window[n]);
+  return NULL;
+}
+
+/**
+ * @name   Coalescing benchmark
+ * @brief  Eager against deferred coalescing on alloc/free churn.
+ *
+ * The thread cache is off, so every free reaches the heap.
+ */
+static void bench_coalesce(void) {
+  static const Workload workloads[] = {
+    { "small",  8192,  16,   256,       200000 },
+    { "mixed",  1024,  16,   32 * 1024, 50000 },
+  };
+  size_t w;
+  int deferred;
+
+  printf("%-8s %-10s %14s %12s %8s\n", "workload", "coalesce", "ops/s", "worst ns", "frag");
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+    for (deferred = 0; deferred < 2; deferred++) {
+      WorkloadResult r;
+
+      simple_mallopt(MM_OPT_DEFERRED_COALESCE, deferred);
+      r = run_workload(&workloads[w]);
+      printf("%-8s %-10s %14.0f %12llu %7.1f%%\n", workloads[w].name, deferred ? "deferred" : "eager",
+             r.ops_per_sec, (unsigned long long) r.worst_ns, 100.0 * r.frag);
+    }
+  }
+  simple_mallopt(MM_OPT_DEFERRED_COALESCE, 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+
+/**
+ * @name   Thread scalability benchmark
+ * @brief  Total malloc/free pairs per second from 1 up to 2x the number of CPUs,
+ *         with a single arena and with one arena per CPU.
+ */
+static void bench_threads(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long arenas[2] = { 1, cpus < 16 ? cpus : 16 };
+  pthread_t threads[64];
+  long t, n;
+  int a;
+
+  printf("%-8s %-8s %14s %14s\n", "threads", "arenas", "ops/s", "ops/s/thread");
+  for (t = 1; t <= 2 * cpus && t <= 64; t *= 2) {
+    for (a = 0; a < 2; a++) {
+      uint64_t t0 = now_ns();
+      double rate;
+
+      simple_mallopt(MM_OPT_ARENAS, arenas[a]);
+      for (n = 0; n < t; n++) pthread_create(&threads[n], NULL, thread_churn, (void *) (uintptr_t) (n + 1));
+      for (n = 0; n < t; n++) pthread_join(threads[n], NULL);
+
+      rate = (double) t * THREAD_OPS * 1e9 / (double) (now_ns() - t0);
+      printf("%-8ld %-8ld %14.0f %14.0f\n", t, arenas[a], rate, rate / t);
+    }
+  }
+}
+
+#define HANDOFF_SLOTS  256
+#define HANDOFF_BLOCKS 200000
+
+/* Ring between one producer and one consumer */
+typedef struct {
+  _Atomic(void *) slot[HANDOFF_SLOTS];
+} Handoff;
+
+static void *producer(void *arg) {
+  Handoff *h = arg;
+  size_t n;
+
+  for (n = 0; n < HANDOFF_BLOCKS; n++) {
+    void *block = simple_malloc(256 + (n & 1023));
+    while (atomic_load_explicit(&h->slot[n % HANDOFF_SLOTS], memory_order_acquire) != NULL) sched_yield();
+    atomic_store_explicit(&h->slot[n % HANDOFF_SLOTS], block, memory_order_release);
+  }
+  return NULL;
+}
+
+static void *consumer(void *arg) {
+  Handoff *h = arg;
+  size_t n;
+
+  for (n = 0; n < HANDOFF_BLOCKS; n++) {
+    void *block;
+    while ((block = atomic_exchange_explicit(&h->slot[n % HANDOFF_SLOTS], NULL, memory_order_acquire)) == NULL) {
+      sched_yield();
+    }
+    simple_free(block);
+  }
+  return NULL;
+}
+
+/**
+ * @name   Producer/consumer benchmark
+ * @brief  Blocks allocated on producer threads and freed on consumer threads,
+ *         with and without the lock-free remote free queue.
+ */
+static void bench_producer_consumer(void) {
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  static Handoff rings[16];
+  pthread_t threads[32];
+  long pairs, n;
+  int remote;
+
+  printf("%-8s %-8s %14s\n", "pairs", "remote", "blocks/s");
+  for (pairs = 1; pairs <= cpus && pairs <= 16; pairs *= 2) {
+    for (remote = 0; remote < 2; remote++) {
+      uint64_t t0 = now_ns();
+
+      simple_mallopt(MM_OPT_REMOTE_FREE, remote);
+      memset(rings, 0, sizeof(rings));
+      for (n = 0; n < pairs; n++) {
+        pthread_create(&threads[2 * n], NULL, producer, &rings[n]);
+        pthread_create(&threads[2 * n + 1], NULL, consumer, &rings[n]);
+      }
+      for (n = 0; n < 2 * pairs; n++) pthread_join(threads[n], NULL);
+
+      printf("%-8ld %-8s %14.0f\n", pairs, remote ? "on" : "off",
+             (double) pairs * HANDOFF_BLOCKS * 1e9 / (double) (now_ns() - t0));
+    }
+  }
+  simple_mallopt(MM_OPT_REMOTE_FREE, 1);
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benchmarks[] = {
+  { "calloc", bench_calloc },
+  { "free_latency", bench_free_latency },
+  { "fragmented_malloc", bench_fragmented_malloc },
+  { "large_mixed", bench_large_mixed },
+  { "policies", bench_policies },
+  { "coalesce", bench_coalesce },
+  { "pool", bench_pool },
+  { "region", bench_region },
+  { "batch", bench_batch },
+  { "persist", bench_persist },
+  { "threads", bench_threads },
+  { "trim", bench_trim },
+  { "huge_pages", bench_huge_pages },
+  { "small_objects", bench_small_objects },
+  { "producer_consumer", bench_producer_consumer },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv) {
+  size_t b;
+  int i;
+
+  for (b = 0; b < NUM_BENCHMARKS; b++) {
+    int selected = (argc < 2);
+    for (i = 1; i < argc; i++) {
+      if (strcmp(argv[i], benchmarks[b].name) == 0) selected = 1;
+    }
+    if (!selected) continue;
+
+    printf("== %s ==\n", benchmarks[b].name);
+    benchmarks[b].run();
+  }
+  return 0;
+}
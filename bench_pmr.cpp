@@ -0,0 +1,161 @@
+/**
+ * @file   bench_pmr.cpp
+ * @brief  Benchmarks of standard containers on the allocator, through mm.hpp,
+ *         against the default allocator of the C++ library.
+ *
+ * Run without arguments to run every benchmark, or give the names of the
+ * benchmarks to run.
+ */
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "mm.hpp"
+
+/* Monotonic time in nanoseconds */
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+// Runs the workload and prints how long it took
+static void timed(const char *name, const std::function<void()> &workload) {
+  uint64_t t0 = now_ns();
+  workload();
+  printf("%-24s %10.1f ms\n", name, (double) (now_ns() - t0) / 1e6);
+}
+
+#define VECTOR_ROUNDS  (200)
+#define VECTOR_COUNT   (256)
+
+// Grows a batch of vectors one element at a time to lengths of up to 4000,
+// so every vector reallocates a dozen times
+template <class Vector, class... Args>
+static void vector_round(Args &&... args) {
+  std::vector<Vector> vectors;
+  size_t v, n;
+
+  vectors.reserve(VECTOR_COUNT);
+  for (v = 0; v < VECTOR_COUNT; v++) vectors.emplace_back(args...);
+  for (v = 0; v < VECTOR_COUNT; v++) {
+    size_t length = (v * 7919) % 4000;
+    for (n = 0; n < length; n++) vectors[v].push_back((int) n);
+  }
+}
+
+/**
+ * @name   Vector benchmark
+ * @brief  Vectors growing by push_back on each allocator.
+ */
+static void bench_vector(void) {
+  timed("std::allocator", [] {
+    for (int r = 0; r < VECTOR_ROUNDS; r++) vector_round<std::vector<int>>();
+  });
+  timed("SimpleAllocator", [] {
+    for (int r = 0; r < VECTOR_ROUNDS; r++) vector_round<std::vector<int, SimpleAllocator<int>>>();
+  });
+  timed("SimpleResource", [] {
+    for (int r = 0; r < VECTOR_ROUNDS; r++) vector_round<std::pmr::vector<int>>(simple_resource());
+  });
+  timed("SimpleMonotonicResource", [] {
+    SimpleMonotonicResource monotonic;
+    for (int r = 0; r < VECTOR_ROUNDS; r++) {
+      vector_round<std::pmr::vector<int>>(&monotonic);
+      monotonic.release();
+    }
+  });
+}
+
+#define MAP_ROUNDS (20)
+#define MAP_KEYS   (100000)
+
+// Fills a map, looks every key up, erases half of them and drops the rest
+template <class Map>
+static void map_round(Map &map) {
+  uint64_t sum = 0;
+  int k;
+
+  for (k = 0; k < MAP_KEYS; k++) map[k * 2654435761u] = k;
+  for (k = 0; k < MAP_KEYS; k++) sum += map.find(k * 2654435761u)->second;
+  for (k = 0; k < MAP_KEYS; k += 2) map.erase(k * 2654435761u);
+  map.clear();
+  if (sum == 0) printf("unexpected sum\n");
+}
+
+/**
+ * @name   Unordered map benchmark
+ * @brief  Node based containers, one allocation per element, on each allocator.
+ */
+static void bench_unordered_map(void) {
+  typedef std::unordered_map<unsigned, int, std::hash<unsigned>, std::equal_to<unsigned>,
+                             SimpleAllocator<std::pair<const unsigned, int>>> SimpleMap;
+
+  timed("std::allocator", [] {
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+      std::unordered_map<unsigned, int> map;
+      map_round(map);
+    }
+  });
+  timed("SimpleAllocator", [] {
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+      SimpleMap map;
+      map_round(map);
+    }
+  });
+  timed("SimpleResource", [] {
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+      std::pmr::unordered_map<unsigned, int> map(simple_resource());
+      map_round(map);
+    }
+  });
+  timed("SimplePoolResource", [] {
+    SimplePoolResource pool;
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+      std::pmr::unordered_map<unsigned, int> map(&pool);
+      map_round(map);
+    }
+  });
+  timed("SimpleMonotonicResource", [] {
+    SimpleMonotonicResource monotonic;
+    for (int r = 0; r < MAP_ROUNDS; r++) {
+      {
+        std::pmr::unordered_map<unsigned, int> map(&monotonic);
+        map_round(map);
+      }
+      monotonic.release();
+    }
+  });
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benchmarks[] = {
+  { "vector", bench_vector },
+  { "unordered_map", bench_unordered_map },
+};
+
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+int main(int argc, char **argv) {
+  size_t b;
+  int i;
+
+  for (b = 0; b < NUM_BENCHMARKS; b++) {
+    int selected = (argc < 2);
+    for (i = 1; i < argc; i++) {
+      if (strcmp(argv[i], benchmarks[b].name) == 0) selected = 1;
+    }
+    if (!selected) continue;
+
+    printf("== %s ==\n", benchmarks[b].name);
+    benchmarks[b].run();
+  }
+  return 0;
+}
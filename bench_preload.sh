@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Times a few allocation heavy programs on the allocator of the C library,
+# and again with libmm.so preloaded (16 and 8 byte alignment)
+
+make -s libmm.so || exit 1
+
+lib="$PWD/libmm.so"
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+seq 1 1000000 | shuf > "$tmp/numbers.txt"
+
+benchmarks=(
+    "python3 -c 'd = {str(i): [i] * 4 for i in range(1000000)}; print(len(sorted(d)))'"
+    "sort -n $tmp/numbers.txt -o $tmp/sorted.txt"
+    "gcc -std=c11 -O2 -c mm.c -o $tmp/mm.o"
+)
+
+# Prints the wall clock seconds of the fastest of three runs
+best_of_three() {
+    local best=""
+    for run in 1 2 3; do
+        local start=${EPOCHREALTIME/./}
+        env "$@" > /dev/null 2>&1 || { echo "failed"; return; }
+        local time=$(( ${EPOCHREALTIME/./} - start ))
+        if [[ -z $best ]] || (( time < best )); then best=$time; fi
+    done
+    printf "%d.%06d" $(( best / 1000000 )) $(( best % 1000000 ))
+}
+
+printf "%-10s %-10s %-10s %s\n" "glibc" "libmm" "libmm(8)" "program"
+for cmd in "${benchmarks[@]}"; do
+    glibc=$(best_of_three bash -c "$cmd")
+    mm=$(best_of_three LD_PRELOAD="$lib" bash -c "$cmd")
+    mm8=$(best_of_three LD_PRELOAD="$lib" SIMPLE_MALLOC_ALIGNMENT=8 bash -c "$cmd")
+    printf "%-10s %-10s %-10s %s\n" "$glibc" "$mm" "$mm8" "${cmd%% *}"
+done
+
+# Use this code in the terminal to run the benchmark: ./bench_preload.sh
@@ -5,9 +5,17 @@
  * @brief  Unit tests and suite for the memory management sub system.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <check.h>
 #include "mm.h"
 
@@ -15,6 +23,13 @@
 #define MALLOC simple_malloc
 #define FREE   simple_free
 
+/* Bytes in front of each object, built with -DMM_BITMAP for the bitmap engine */
+#ifdef MM_BITMAP
+#define OBJECT_HEADER 0
+#else
+#define OBJECT_HEADER sizeof(void *)
+#endif
+
 /**
  * @name: Utility function to XOR a block of memory. 
  */
@@ -213,15 +228,22 @@ START_TEST (test_memory_exerciser)
       FREE(blocks[clock].addr);
     }
   }
+  ck_assert_int_eq(simple_heap_check(), 0);
 }
 END_TEST
 
 /**
  * @name   Non-first-fit strategy test
- * @brief  Tests whether the memory manager uses next-fit allocation strategy.
+ * @brief  Tests whether the memory manager uses next-fit allocation strategy
+ *         when asked to.
  */
 START_TEST (test_non_first_fit)
 {  
+  // Freed blocks must go back to the heap, not to the thread cache
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_POLICY, MM_POLICY_NEXT_FIT), 0);
+
   // First allocation - 400 bytes
   void *blockA = MALLOC(400);
   ck_assert(blockA != NULL);
@@ -234,20 +256,20 @@ START_TEST (test_non_first_fit)
   void *blockC = MALLOC(200);
   ck_assert(blockC != NULL);
 
-  // Free blockC first - this sets the "current" pointer in this region
-  FREE(blockC);
+  // Free blockB - it is enclosed by allocated blocks, so it stays a hole
+  FREE(blockB);
 
-  // Allocate blockD - in next-fit, this should create a new block after blockB
-  void *blockD = MALLOC(150);
+  // Allocate blockD - first-fit would reuse blockB, next-fit continues after blockC
+  void *blockD = MALLOC(50);
   ck_assert(blockD != NULL);
   
-  // Verify blockD is a new block after blockB
-  ck_assert_msg((uintptr_t)blockD > (uintptr_t)blockB, 
-                "Next-fit should have allocated blockD after blockB");
-  ck_assert_msg(blockD != blockC, 
-                "Next-fit should create a new block, not reuse blockC");
+  // Verify blockD is a new block after blockC
+  ck_assert_msg((uintptr_t)blockD > (uintptr_t)blockC, 
+                "Next-fit should have allocated blockD after blockC");
+  ck_assert_msg(blockD != blockB, 
+                "Next-fit should create a new block, not reuse blockB");
 
-  // Now free blockA
+  // Now free blockA, which coalesces with the hole left by blockB
   FREE(blockA);
 
   // Allocate blockE - in next-fit, this should create a new block after blockD
@@ -261,12 +283,1073 @@ START_TEST (test_non_first_fit)
                 "Next-fit should create a new block, not reuse blockA");
 
   // Clean up
+  FREE(blockC);
+  FREE(blockD);
+  FREE(blockE);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_BEST_FIT);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+
+/**
+ * @name   First-fit strategy test
+ * @brief  Tests whether first-fit reuses the lowest hole that fits.
+ */
+START_TEST (test_first_fit)
+{
+  // Freed blocks must go back to the heap, not to the thread cache
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_POLICY, MM_POLICY_FIRST_FIT), 0);
+
+  void *blockA = MALLOC(400);
+  void *blockB = MALLOC(100);
+  void *blockC = MALLOC(200);
+  void *blockD = MALLOC(100);
+  ck_assert(blockA != NULL && blockB != NULL && blockC != NULL && blockD != NULL);
+
+  // Two holes, the lower one is larger than needed
+  FREE(blockA);
+  FREE(blockC);
+
+  // First-fit takes blockA although blockC fits better
+  void *blockE = MALLOC(150);
+  ck_assert_msg(blockE == blockA, "First-fit should have reused blockA");
+
   FREE(blockB);
   FREE(blockD);
   FREE(blockE);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_BEST_FIT);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
 }
 END_TEST
 
+/**
+ * @name   Placement policy test
+ * @brief  Runs the same allocation pattern under every policy.
+ */
+START_TEST (test_policies)
+{
+  int policies[4] = { MM_POLICY_FIRST_FIT, MM_POLICY_NEXT_FIT, MM_POLICY_BEST_FIT, MM_POLICY_TLSF };
+  void *blocks[64];
+  int p, n;
+
+  ck_assert_int_ne(simple_mallopt(MM_OPT_POLICY, 42), 0);
+  ck_assert_int_ne(simple_mallopt(-1, 0), 0);
+
+  for (p = 0; p < 4; p++) {
+    ck_assert_int_eq(simple_mallopt(MM_OPT_POLICY, policies[p]), 0);
+
+    for (n = 0; n < 64; n++) {
+      blocks[n] = MALLOC(16 + 97 * n);
+      ck_assert(blocks[n] != NULL);
+      memset(blocks[n], n, 16 + 97 * n);
+    }
+    for (n = 0; n < 64; n += 3) {
+      FREE(blocks[n]);
+      blocks[n] = MALLOC(16 + 97 * (63 - n));
+      ck_assert(blocks[n] != NULL);
+      memset(blocks[n], n, 16 + 97 * (63 - n));
+    }
+    ck_assert_int_eq(simple_heap_check(), 0);
+
+    for (n = 0; n < 64; n++) {
+      uint8_t *data = blocks[n];
+      ck_assert(data[0] == n && data[(n % 3 ? 16 + 97 * n : 16 + 97 * (63 - n)) - 1] == n);
+      FREE(blocks[n]);
+    }
+    ck_assert_int_eq(simple_heap_check(), 0);
+  }
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_BEST_FIT);
+}
+END_TEST
+
+/**
+ * @name   Segregated fit strategy test
+ * @brief  Tests whether small allocations reuse holes from their size class
+ *         instead of carving up the rest of the arena.
+ */
+START_TEST (test_segregated_fit)
+{  
+  // Freed blocks must go back to the heap, not to the thread cache
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+
+  // First allocation - 400 bytes
+  void *blockA = MALLOC(400);
+  ck_assert(blockA != NULL);
+  
+  // Second allocation - 100 bytes
+  void *blockB = MALLOC(100);
+  ck_assert(blockB != NULL);
+  
+  // Third allocation - 200 bytes
+  void *blockC = MALLOC(200);
+  ck_assert(blockC != NULL);
+
+  // Free blockB - it is enclosed by allocated blocks, so it stays a hole
+  FREE(blockB);
+
+  // Allocate blockD - the smallest class with a free block is blockB's
+  void *blockD = MALLOC(50);
+  ck_assert_msg(blockD == blockB,
+                "Segregated fit should have reused the hole left by blockB");
+
+  // Now free blockA, blockD keeps it from coalescing
+  FREE(blockA);
+
+  // Allocate blockE - blockA's class is the smallest that fits
+  void *blockE = MALLOC(150);
+  ck_assert_msg(blockE == blockA,
+                "Segregated fit should have reused the hole left by blockA");
+
+  // Clean up
+  FREE(blockC);
+  FREE(blockD);
+  FREE(blockE);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+
+
+/**
+ * @name   Boundary tag coalescing test
+ * @brief  Tests that freed neighbours are merged in both directions.
+ */
+START_TEST (test_coalescing)
+{
+  void *blocks[8];
+  int n;
+
+  for (n = 0; n < 8; n++) {
+    blocks[n] = MALLOC(64);
+    ck_assert(blocks[n] != NULL);
+  }
+
+  // Free every other block, then the ones in between so that each free
+  // merges with a free block on both sides
+  for (n = 0; n < 8; n += 2) {
+    FREE(blocks[n]);
+    ck_assert_int_eq(simple_heap_check(), 0);
+  }
+  for (n = 1; n < 8; n += 2) {
+    FREE(blocks[n]);
+    ck_assert_int_eq(simple_heap_check(), 0);
+  }
+
+  // Zero sized blocks still need room for the boundary tag when freed
+  void *tiny = MALLOC(0);
+  void *next = MALLOC(8);
+  ck_assert(tiny != NULL && next != NULL);
+  FREE(tiny);
+  FREE(next);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+#ifndef MM_BITMAP
+/**
+ * @name   Large best fit test
+ * @brief  Tests that large requests take the smallest hole that fits.
+ */
+START_TEST (test_large_best_fit)
+{
+  uint32_t sizes[5] = { 40000, 24576, 20000, 24576, 100000 };
+  void *holes[5];
+  void *pins[5];
+  void *ptr;
+  int n;
+
+  // Freed blocks must go back to the heap, not to the thread cache
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+
+  // Holes separated by pinned blocks so that they cannot coalesce
+  for (n = 0; n < 5; n++) {
+    holes[n] = MALLOC(sizes[n]);
+    pins[n] = MALLOC(64);
+    ck_assert(holes[n] != NULL && pins[n] != NULL);
+  }
+  for (n = 0; n < 5; n++) {
+    FREE(holes[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Two holes of 24576 bytes are the best fit
+  ptr = MALLOC(22000);
+  ck_assert_msg(ptr == holes[1] || ptr == holes[3], "Expected one of the 24576 byte holes");
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // No hole of the same class fits, the smallest of the next class does
+  ck_assert(MALLOC(30000) == holes[0]);
+  ck_assert(MALLOC(20000) == holes[2]);
+  ck_assert(MALLOC(24000) == (ptr == holes[1] ? holes[3] : holes[1]));
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  for (n = 0; n < 4; n++) {
+    FREE(holes[n]);
+  }
+  for (n = 0; n < 5; n++) {
+    FREE(pins[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+#endif
+
+/**
+ * @name   Realloc test
+ * @brief  Tests that simple_realloc shrinks and grows in place and keeps the contents.
+ */
+START_TEST (test_realloc)
+{
+  uint8_t *a, *b;
+  int n;
+
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  a = MALLOC(4000);
+  ck_assert(a != NULL);
+  for (n = 0; n < 4000; n++) a[n] = (uint8_t) n;
+
+  // Shrinking frees the tail, growing again takes it back
+  ck_assert_ptr_eq(simple_realloc(a, 1000), a);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  ck_assert_ptr_eq(simple_realloc(a, 4000), a);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  for (n = 0; n < 1000; n++) ck_assert_int_eq(a[n], (uint8_t) n);
+
+  // Doubling like a growing array, moved or not the contents stay
+  for (n = 0; n < 1000; n++) a[n] = (uint8_t) (n * 7);
+  b = MALLOC(64);
+  for (size_t size = 8000; size <= 512 * 1024; size *= 2) {
+    a = simple_realloc(a, size);
+    ck_assert(a != NULL);
+  }
+  for (n = 0; n < 1000; n++) ck_assert_int_eq(a[n], (uint8_t) (n * 7));
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  ck_assert_ptr_eq(simple_realloc(a, 0), NULL);
+  a = simple_realloc(NULL, 100);
+  ck_assert(a != NULL);
+  FREE(a);
+  FREE(b);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+
+/* Checks that a block is all zero */
+static int is_zero(const uint8_t *block, size_t size)
+{
+  size_t n;
+
+  for (n = 0; n < size; n++) {
+    if (block[n] != 0) return 0;
+  }
+  return 1;
+}
+
+/**
+ * @name   Calloc test
+ * @brief  Tests that simple_calloc clears recycled memory as well as pristine memory.
+ */
+START_TEST (test_calloc)
+{
+  uint8_t *a, *b;
+  size_t size;
+
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  for (size = 40; size <= 256 * 1024; size *= 4) {
+    a = MALLOC(size);
+    ck_assert(a != NULL);
+    memset(a, 0xAA, size);
+    FREE(a);
+
+    b = simple_calloc(size / 8, 8);
+    ck_assert(b != NULL);
+    ck_assert_msg(is_zero(b, size), "Recycled block of %zu bytes not cleared", size);
+    memset(b, 0x55, size);
+    FREE(b);
+    ck_assert_int_eq(simple_heap_check(), 0);
+  }
+
+  // Likely beyond anything handed out so far
+  a = simple_calloc(1, 4 * 1024 * 1024);
+  ck_assert(a != NULL);
+  ck_assert(is_zero(a, 4 * 1024 * 1024));
+  FREE(a);
+
+  ck_assert_ptr_eq(simple_calloc(SIZE_MAX / 2, 4), NULL);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+
+/**
+ * @name   Aligned allocation test
+ * @brief  Tests simple_aligned_alloc alignments and that the padding is given back.
+ */
+START_TEST (test_aligned_alloc)
+{
+  size_t alignment;
+  void *blocks[16];
+  int n;
+
+  ck_assert_ptr_eq(simple_aligned_alloc(24, 100), NULL);
+  for (alignment = 8; alignment <= 64 * 1024; alignment *= 2) {
+    for (n = 0; n < 16; n++) {
+      blocks[n] = simple_aligned_alloc(alignment, 1 + n * 100);
+      ck_assert(blocks[n] != NULL);
+      ck_assert_uint_eq((uintptr_t) blocks[n] % alignment, 0);
+      memset(blocks[n], n, 1 + n * 100);
+    }
+    ck_assert_int_eq(simple_heap_check(), 0);
+    for (n = 0; n < 16; n++) {
+      FREE(blocks[n]);
+    }
+    ck_assert_int_eq(simple_heap_check(), 0);
+  }
+
+  // Would run out of memory if the padding leaked
+  for (n = 0; n < 10000; n++) {
+    void *page = simple_aligned_alloc(64 * 1024, 1000);
+    ck_assert(page != NULL);
+    FREE(page);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+#ifndef MM_BITMAP
+  // A freed aligned block comes back from the thread cache
+  blocks[0] = simple_aligned_alloc(16, 40);
+  FREE(blocks[0]);
+  ck_assert_ptr_eq(simple_aligned_alloc(16, 40), blocks[0]);
+  FREE(blocks[0]);
+#endif
+}
+END_TEST
+
+/**
+ * @name   Pool test
+ * @brief  Tests that pool objects are distinct, keep their contents and are reused.
+ */
+START_TEST (test_pool)
+{
+  static uint32_t *objs[10000];
+  SimplePool *pool = simple_pool_create(20);
+  int n;
+
+  ck_assert(pool != NULL);
+  ck_assert(simple_pool_create(0) == NULL);
+
+  for (n = 0; n < 10000; n++) {
+    objs[n] = simple_pool_alloc(pool);
+    ck_assert(objs[n] != NULL);
+    ck_assert_uint_eq((uintptr_t) objs[n] % sizeof(void *), 0);
+    objs[n][0] = n;
+    objs[n][4] = n;
+  }
+  for (n = 0; n < 10000; n++) {
+    ck_assert_uint_eq(objs[n][0], (uint32_t) n);
+    ck_assert_uint_eq(objs[n][4], (uint32_t) n);
+  }
+
+  // Freed objects come back first
+  simple_pool_free(pool, objs[10]);
+  simple_pool_free(pool, objs[20]);
+  ck_assert_ptr_eq(simple_pool_alloc(pool), objs[20]);
+  ck_assert_ptr_eq(simple_pool_alloc(pool), objs[10]);
+
+  simple_pool_destroy(pool);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/**
+ * @name   Region test
+ * @brief  Tests region allocation across chunks, empty objects, reset and destroy.
+ */
+START_TEST (test_region)
+{
+  SimpleRegion *region = simple_region_create();
+  uint8_t *first, *obj, *big;
+  int round, n;
+
+  ck_assert(region != NULL);
+  first = simple_region_alloc(region, 0);
+  ck_assert(first != NULL);
+  ck_assert(simple_region_alloc(region, 0) != first);
+  simple_region_reset(region);
+
+  for (round = 0; round < 3; round++) {
+    for (n = 0; n < 5000; n++) {
+      obj = simple_region_alloc(region, 1 + n % 300);
+      ck_assert(obj != NULL);
+      ck_assert_uint_eq((uintptr_t) obj % sizeof(void *), 0);
+      memset(obj, n, 1 + n % 300);
+    }
+    big = simple_region_alloc(region, 2 * 1024 * 1024);
+    ck_assert(big != NULL);
+    ck_assert_int_eq(simple_heap_check(), 0);
+
+    // Starts over in the chunk it kept, not the one grown for the large object
+    simple_region_reset(region);
+    first = simple_region_alloc(region, 10);
+    ck_assert(first != NULL);
+    ck_assert(first < big || first >= big + 2 * 1024 * 1024);
+    simple_region_reset(region);
+    ck_assert_ptr_eq(simple_region_alloc(region, 10), first);
+    simple_region_reset(region);
+  }
+  simple_region_destroy(region);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/**
+ * @name   Handle test
+ * @brief  Tests that compaction slides unlocked blocks together and keeps locked ones.
+ */
+START_TEST (test_handles)
+{
+  const size_t stride = 1000 + OBJECT_HEADER;
+  SimpleHandle *handles[64];
+  uintptr_t before[64];
+  uint32_t *data;
+  int n, i;
+
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  for (n = 0; n < 64; n++) {
+    handles[n] = simple_halloc(1000);
+    ck_assert(handles[n] != NULL);
+    data = simple_hlock(handles[n]);
+    for (i = 0; i < 250; i++) data[i] = n * 1000 + i;
+    simple_hunlock(handles[n]);
+  }
+  for (n = 0; n < 64; n += 2) {
+    simple_hfree(handles[n]);
+  }
+  for (n = 1; n < 64; n += 2) {
+    before[n] = (uintptr_t) simple_hlock(handles[n]);
+    simple_hunlock(handles[n]);
+  }
+
+  // A locked block stays put
+  data = simple_hlock(handles[1]);
+  ck_assert_uint_gt(simple_compact(), 0);
+  ck_assert_ptr_eq(simple_hlock(handles[1]), data);
+  simple_hunlock(handles[1]);
+  simple_hunlock(handles[1]);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  for (n = 0; n < 100 && simple_compact() != 0; n++);
+  ck_assert_uint_eq(simple_compact(), 0);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Blocks that had a hole between them are now next to each other
+  for (n = 1; n < 64; n += 2) {
+    uintptr_t ptr = (uintptr_t) simple_hlock(handles[n]);
+    data = (uint32_t *) ptr;
+    for (i = 0; i < 250; i++) ck_assert_uint_eq(data[i], (uint32_t) (n * 1000 + i));
+    if (n > 1 && before[n] - before[n - 2] == 2 * stride) {
+      ck_assert_uint_eq(ptr - (uintptr_t) simple_hlock(handles[n - 2]), stride);
+      simple_hunlock(handles[n - 2]);
+    }
+    simple_hunlock(handles[n]);
+  }
+  for (n = 1; n < 64; n += 2) {
+    simple_hfree(handles[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+
+/* Node of the list kept in the persistent heap test, linked by offsets */
+typedef struct {
+  uint64_t next;
+  uint32_t value;
+} PersistNode;
+
+/**
+ * @name   Persistent heap test
+ * @brief  Tests that a heap reopened at another address still holds its data.
+ */
+START_TEST (test_persist)
+{
+  char path[] = "/tmp/check_mm_persistXXXXXX";
+  int fd = mkstemp(path);
+  SimplePersist *heap;
+  PersistNode *node, *next, *prev = NULL, *head = NULL;
+  void *old_base, *blocker;
+  uint32_t n;
+
+  ck_assert(fd >= 0);
+  close(fd);
+  heap = simple_persist_open(path, 1024 * 1024);
+  ck_assert(heap != NULL);
+  for (n = 0; n < 1000; n++) {
+    node = simple_persist_alloc(heap, sizeof(PersistNode) + n % 100);
+    ck_assert(node != NULL);
+    node->value = n;
+    node->next = simple_persist_offset(heap, head);
+    head = node;
+  }
+  ck_assert_int_eq(simple_persist_set_root(heap, "list", head), 0);
+  ck_assert_int_ne(simple_persist_set_root(heap, "a name longer than thirty one characters", head), 0);
+  ck_assert(simple_persist_alloc(heap, 2 * 1024 * 1024) == NULL);
+  old_base = simple_persist_pointer(heap, 1);
+  ck_assert_int_eq(simple_persist_close(heap), 0);
+
+  // Keep the old address taken, so the file has to go elsewhere
+  blocker = mmap((uint8_t *) old_base - 1, 1024 * 1024, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+  heap = simple_persist_open(path, 0);
+  ck_assert(heap != NULL);
+  ck_assert(simple_persist_root(heap, "nothing") == NULL);
+  node = simple_persist_root(heap, "list");
+  for (n = 1000; n-- > 0; ) {
+    ck_assert(node != NULL);
+    ck_assert_uint_eq(node->value, n);
+    next = simple_persist_pointer(heap, node->next);
+    if (n % 2 == 0) {
+      simple_persist_free(heap, node);  // Every other node leaves the list
+      prev->next = simple_persist_offset(heap, next);
+    } else {
+      prev = node;
+    }
+    node = next;
+  }
+  ck_assert(node == NULL);
+  ck_assert_int_eq(simple_persist_close(heap), 0);
+  if (blocker != MAP_FAILED) munmap(blocker, 1024 * 1024);
+
+  // Free blocks are found again on open and merge with their neighbours
+  heap = simple_persist_open(path, 0);
+  ck_assert(heap != NULL);
+  node = simple_persist_root(heap, "list");
+  for (n = 0; node != NULL; n++, node = next) {
+    next = simple_persist_pointer(heap, node->next);
+    ck_assert_uint_eq(node->value, 999 - 2 * n);
+    simple_persist_free(heap, node);
+  }
+  ck_assert_uint_eq(n, 500);
+  ck_assert_int_eq(simple_persist_set_root(heap, "list", NULL), 0);
+  ck_assert(simple_persist_alloc(heap, 1000 * 1024) != NULL);
+  ck_assert_int_eq(simple_persist_close(heap), 0);
+  unlink(path);
+}
+END_TEST
+
+/**
+ * @name   Heap growth test
+ * @brief  Tests allocations beyond the static memory, served from mapped segments.
+ */
+START_TEST (test_heap_growth)
+{
+  size_t managed = memory_end - memory_start;
+  uint8_t *blocks[12];
+  uint8_t *huge;
+  int n;
+
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 0);  // Keep the blocks in the heap
+  for (n = 0; n < 12; n++) {
+    blocks[n] = MALLOC(managed / 8);
+    ck_assert_msg(blocks[n] != NULL, "Heap did not grow for block %d", n);
+    blocks[n][0] = n;
+    blocks[n][managed / 8 - 1] = n;
+  }
+  huge = simple_calloc(1, managed + 1);
+  ck_assert(huge != NULL);
+  ck_assert(huge[0] == 0 && huge[managed] == 0);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  for (n = 0; n < 12; n++) {
+    ck_assert(blocks[n][0] == n && blocks[n][managed / 8 - 1] == n);
+    FREE(blocks[n]);
+  }
+  FREE(huge);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024);
+}
+END_TEST
+
+/**
+ * @name   Mapped block test
+ * @brief  Tests that huge requests stay off the heap and can be resized and freed.
+ */
+START_TEST (test_mmap)
+{
+  uint8_t *huge;
+  size_t n, footprint;
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024), 0);
+  footprint = simple_heap_footprint();
+  huge = MALLOC(3 * 1024 * 1024);
+  ck_assert(huge != NULL);
+  ck_assert((uintptr_t) huge < memory_start || (uintptr_t) huge >= memory_end);
+  ck_assert_uint_eq(simple_heap_footprint(), footprint);
+  for (n = 0; n < 3 * 1024 * 1024; n += 4096) huge[n] = (uint8_t) (n >> 12);
+
+  huge = simple_realloc(huge, 9 * 1024 * 1024);
+  ck_assert(huge != NULL);
+  huge[9 * 1024 * 1024 - 1] = 1;
+  for (n = 0; n < 3 * 1024 * 1024; n += 4096) ck_assert_uint_eq(huge[n], (uint8_t) (n >> 12));
+
+  // Back to the heap once it falls below the threshold
+  huge = simple_realloc(huge, 100 * 4096);
+  ck_assert(huge != NULL);
+  ck_assert((uintptr_t) huge >= memory_start && (uintptr_t) huge < memory_end);
+  for (n = 0; n < 100 * 4096; n += 4096) ck_assert_uint_eq(huge[n], (uint8_t) (n >> 12));
+  ck_assert_uint_ge(simple_heap_footprint(), 100 * 4096);
+  FREE(huge);
+
+  huge = simple_calloc(2, 1024 * 1024);
+  ck_assert(huge != NULL && huge[0] == 0 && huge[2 * 1024 * 1024 - 1] == 0);
+  FREE(huge);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/**
+ * @name   Trim test
+ * @brief  Tests that free pages are given back and blocks around them stay intact.
+ */
+START_TEST (test_trim)
+{
+  uint8_t *blocks[8];
+  int n;
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_TRIM_THRESHOLD, -1), 2);
+  for (n = 0; n < 8; n++) {
+    blocks[n] = MALLOC(512 * 1024);
+    ck_assert(blocks[n] != NULL);
+    memset(blocks[n], n, 512 * 1024);
+  }
+  for (n = 0; n < 8; n += 2) {
+    FREE(blocks[n]);
+  }
+  ck_assert_uint_gt(simple_trim(), 0);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  for (n = 1; n < 8; n += 2) {
+    ck_assert(blocks[n][0] == n && blocks[n][512 * 1024 - 1] == n);
+  }
+
+  // Given back pages come back on use
+  for (n = 0; n < 8; n += 2) {
+    blocks[n] = MALLOC(512 * 1024);
+    ck_assert(blocks[n] != NULL);
+    memset(blocks[n], n, 512 * 1024);
+  }
+
+  // Neighbours freed into a block past the threshold are trimmed on free
+  ck_assert_int_eq(simple_mallopt(MM_OPT_TRIM_THRESHOLD, 1024 * 1024), 0);
+  for (n = 2; n < 6; n++) {
+    FREE(blocks[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+  ck_assert(blocks[1][512 * 1024 - 1] == 1 && blocks[6][0] == 6);
+  for (n = 2; n < 6; n++) {
+    blocks[n] = MALLOC(512 * 1024);
+    ck_assert(blocks[n] != NULL);
+    memset(blocks[n], n, 512 * 1024);
+  }
+  for (n = 0; n < 8; n++) {
+    FREE(blocks[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/**
+ * @name   Huge page test
+ * @brief  Tests that the heap works, and grows, with huge pages asked for.
+ */
+START_TEST (test_huge_pages)
+{
+  size_t managed = memory_end - memory_start;
+  uint8_t *big, *small;
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_HUGE_PAGES, 3), 2);
+  ck_assert_int_eq(simple_mallopt(MM_OPT_HUGE_PAGES, MM_HUGE_PAGES_THP), 0);
+  small = MALLOC(5000);
+  ck_assert(small != NULL);
+  memset(small, 1, 5000);
+
+  // Falls back on transparent huge pages when none are reserved
+  ck_assert_int_eq(simple_mallopt(MM_OPT_HUGE_PAGES, MM_HUGE_PAGES_HUGETLB), 0);
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 0);
+  big = MALLOC(managed + 1);
+  ck_assert(big != NULL);
+  big[0] = 1;
+  big[managed] = 1;
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  FREE(big);
+  FREE(small);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_MMAP_THRESHOLD, 1024 * 1024);
+  simple_mallopt(MM_OPT_HUGE_PAGES, MM_HUGE_PAGES_OFF);
+}
+END_TEST
+
+/**
+ * @name   Small object test
+ * @brief  Tests that small objects are packed without headers and freed by address.
+ */
+START_TEST (test_small_pages)
+{
+  static uint64_t *objs[20000];
+  int packed = 0;
+  int n;
+
+  simple_mallopt(MM_OPT_SMALL_PAGES, 1);
+  for (n = 0; n < 20000; n++) {
+    objs[n] = MALLOC(8);
+    ck_assert(objs[n] != NULL);
+    *objs[n] = n;
+    if (n > 0 && (uintptr_t) objs[n] - (uintptr_t) objs[n - 1] == 8) packed++;
+  }
+  ck_assert_msg(packed > 19000, "Only %d of the objects are packed", packed);
+  for (n = 0; n < 20000; n++) {
+    ck_assert_uint_eq(*objs[n], (uint64_t) n);
+  }
+
+  // Mixed sizes, freed out of order
+  for (n = 0; n < 20000; n += 2) {
+    FREE(objs[n]);
+    objs[n] = MALLOC(1 + n % 64);
+    ck_assert(objs[n] != NULL);
+    memset(objs[n], 0xEE, 1 + n % 64);
+  }
+  for (n = 1; n < 20000; n += 2) {
+    ck_assert_uint_eq(*objs[n], (uint64_t) n);
+  }
+
+  objs[1] = simple_realloc(objs[1], 200);
+  ck_assert(objs[1] != NULL);
+  ck_assert_uint_eq(*objs[1], 1);
+
+  simple_mallopt(MM_OPT_SMALL_PAGES, 0);
+  for (n = 0; n < 20000; n++) {
+    FREE(objs[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+#ifndef MM_BITMAP
+/**
+ * @name   Deferred coalescing test
+ * @brief  Tests that freed blocks are reused as they are and merged on demand.
+ */
+START_TEST (test_deferred_coalesce)
+{
+  void *blocks[64];
+  int n;
+
+  simple_mallopt(MM_OPT_THREAD_CACHE, 0);
+  simple_mallopt(MM_OPT_DEFERRED_COALESCE, 1);
+  for (n = 0; n < 64; n++) {
+    blocks[n] = MALLOC(100);
+    ck_assert(blocks[n] != NULL);
+  }
+  for (n = 0; n < 64; n++) {
+    FREE(blocks[n]);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Same size comes back without splitting anything
+  ck_assert_ptr_eq(MALLOC(100), blocks[63]);
+  ck_assert_ptr_eq(MALLOC(100), blocks[62]);
+  FREE(blocks[62]);
+  FREE(blocks[63]);
+
+  simple_coalesce();
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  for (n = 0; n < 64; n++) {
+    blocks[n] = MALLOC(8 + n * 7);
+    ck_assert(blocks[n] != NULL);
+  }
+  for (n = 0; n < 64; n++) {
+    FREE(blocks[n]);
+  }
+  simple_mallopt(MM_OPT_DEFERRED_COALESCE, 0);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_THREAD_CACHE, 16);
+}
+END_TEST
+#endif
+
+/**
+ * @name   Batch test
+ * @brief  Tests batch allocation from contiguous memory and batch free in any order.
+ */
+START_TEST (test_batch)
+{
+  static void *objs[1003], *mixed[3000];
+  size_t n, contiguous = 0;
+
+  ck_assert_uint_eq(simple_malloc_batch(40, 1000, objs), 1000);
+  for (n = 0; n < 1000; n++) {
+    memset(objs[n], (int) n, 40);
+    if (n > 0 && (uintptr_t) objs[n] - (uintptr_t) objs[n - 1] == 40 + OBJECT_HEADER) contiguous++;
+  }
+  ck_assert_uint_eq(contiguous, 999);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Freed one by one or together, in any order
+  FREE(objs[500]);
+  objs[500] = NULL;
+  for (n = 0; n < 1000; n += 7) {
+    void *tmp = objs[n];
+    objs[n] = objs[999 - n];
+    objs[999 - n] = tmp;
+  }
+  objs[1000] = MALLOC(3 * 1024 * 1024);
+  objs[1001] = MALLOC(100);
+  objs[1002] = NULL;
+  simple_free_batch(objs, 1003);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Span objects in between heap blocks, enough to empty whole spans, freed
+  // without the remote free lists
+  simple_mallopt(MM_OPT_REMOTE_FREE, 0);
+  for (n = 0; n < 3000; n++) {
+    simple_mallopt(MM_OPT_SMALL_PAGES, n % 100 != 0);
+    mixed[n] = MALLOC(n % 100 != 0 ? 64 : 400);
+  }
+  simple_mallopt(MM_OPT_SMALL_PAGES, 0);
+  simple_free_batch(mixed, 3000);
+  simple_mallopt(MM_OPT_REMOTE_FREE, 1);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/**
+ * @name   Sized free test
+ * @brief  Tests freeing with the allocated size, and the usable size, for heap
+ *         blocks, spans and mappings.
+ */
+START_TEST (test_free_sized)
+{
+  void *ptr = MALLOC(40);
+  void *big;
+  int n;
+
+  ck_assert_uint_ge(simple_usable_size(ptr), 40);
+  ck_assert_uint_eq(simple_usable_size(NULL), 0);
+
+  // The cached block is handed out again for the same size
+  simple_free_sized(ptr, 40);
+  ck_assert_ptr_eq(MALLOC(40), ptr);
+  ptr = simple_realloc(ptr, 1000);
+  simple_free_sized(ptr, 1000);
+  simple_free_sized(NULL, 10);
+
+  big = MALLOC(2 * 1024 * 1024);
+  ck_assert_uint_ge(simple_usable_size(big), 2 * 1024 * 1024);
+  simple_free_sized(big, 2 * 1024 * 1024);
+
+  simple_mallopt(MM_OPT_SMALL_PAGES, 1);
+  for (n = 1; n <= 64; n++) {
+    ptr = MALLOC(n);
+    memset(ptr, n, n);
+    ck_assert_uint_ge(simple_usable_size(ptr), (size_t)n);
+    simple_free_sized(ptr, n);
+  }
+  simple_mallopt(MM_OPT_SMALL_PAGES, 0);
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+#ifdef MM_BITMAP
+/**
+ * @name   Bitmap engine test
+ * @brief  Tests that objects have no header and free runs are found and merged.
+ */
+START_TEST (test_bitmap)
+{
+  uint8_t *a, *b, *c, *d;
+
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_FIRST_FIT);
+  a = MALLOC(24);
+  b = MALLOC(24);
+  c = MALLOC(24);
+  ck_assert_ptr_eq(b, a + 24);
+  ck_assert_ptr_eq(c, b + 24);
+
+  // The hole between a and c is the lowest that fits
+  FREE(b);
+  ck_assert_ptr_eq(MALLOC(20), b);
+  simple_free_sized(b, 20);
+
+  // Neighbours merge without touching the objects
+  FREE(a);
+  d = MALLOC(48);
+  ck_assert_ptr_eq(d, a);
+  ck_assert_int_eq(simple_heap_check(), 0);
+
+  // Shrinks, then grows back into its own tail
+  ck_assert_ptr_eq(simple_realloc(d, 8), d);
+  ck_assert_ptr_eq(simple_realloc(d, 48), d);
+  FREE(c);
+  FREE(d);
+  ck_assert_int_eq(simple_heap_check(), 0);
+  simple_mallopt(MM_OPT_POLICY, MM_POLICY_BEST_FIT);
+}
+END_TEST
+#endif
+
+/* Worker for the thread test: random allocations, checked before they are freed */
+static void *thread_worker(void *arg)
+{
+  unsigned int seed = (unsigned int) (uintptr_t) arg;
+  uint8_t *blocks[32] = { NULL };
+  size_t sizes[32];
+  int n, i;
+
+  for (n = 0; n < 20000; n++) {
+    i = rand_r(&seed) & 31;
+    if (blocks[i] != NULL) {
+      if (blocks[i][0] != (uint8_t) i || blocks[i][sizes[i] - 1] != (uint8_t) i) return (void *) 1;
+      FREE(blocks[i]);
+    }
+    sizes[i] = 1 + rand_r(&seed) % (n & 1 ? 200 : 4000);
+    blocks[i] = MALLOC(sizes[i]);
+    if (blocks[i] == NULL) return (void *) 1;
+    memset(blocks[i], i, sizes[i]);
+  }
+  for (i = 0; i < 32; i++) {
+    FREE(blocks[i]);
+  }
+  return NULL;
+}
+
+/**
+ * @name   Thread test
+ * @brief  Tests concurrent allocation from several threads.
+ */
+START_TEST (test_threads)
+{
+  pthread_t threads[4];
+  void *ret;
+  int n;
+
+  for (n = 0; n < 4; n++) {
+    ck_assert_int_eq(pthread_create(&threads[n], NULL, thread_worker, (void *) (uintptr_t) (n + 1)), 0);
+  }
+  for (n = 0; n < 4; n++) {
+    pthread_join(threads[n], &ret);
+    ck_assert_msg(ret == NULL, "Thread %d found a damaged block", n);
+  }
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+#define HANDOFF_SLOTS 64
+#define HANDOFF_BLOCKS 20000
+
+/* Single producer, single consumer ring used to hand blocks between threads */
+static _Atomic(uint32_t *) handoff[HANDOFF_SLOTS];
+
+static void *producer_worker(void *arg)
+{
+  uint32_t n;
+
+  for (n = 0; n < HANDOFF_BLOCKS; n++) {
+    uint32_t size = 300 + n % 2000;
+    uint32_t *block = MALLOC(size);
+    if (block == NULL) return (void *) 1;
+    block[0] = n;
+    block[size / 4 - 1] = n;
+    while (atomic_load(&handoff[n % HANDOFF_SLOTS]) != NULL) sched_yield();
+    atomic_store(&handoff[n % HANDOFF_SLOTS], block);
+  }
+  return NULL;
+}
+
+static void *consumer_worker(void *arg)
+{
+  uint32_t n;
+  int damaged = 0;
+
+  for (n = 0; n < HANDOFF_BLOCKS; n++) {
+    uint32_t *block;
+    while ((block = atomic_exchange(&handoff[n % HANDOFF_SLOTS], NULL)) == NULL) sched_yield();
+    if (block[0] != n || block[(300 + n % 2000) / 4 - 1] != n) damaged = 1;
+    FREE(block);
+  }
+  return damaged ? (void *) 1 : NULL;
+}
+
+/**
+ * @name   Producer/consumer test
+ * @brief  Tests blocks allocated on one thread and freed on another.
+ */
+START_TEST (test_producer_consumer)
+{
+  pthread_t producer, consumer;
+  void *ret_producer, *ret_consumer;
+
+  ck_assert_int_eq(pthread_create(&producer, NULL, producer_worker, NULL), 0);
+  ck_assert_int_eq(pthread_create(&consumer, NULL, consumer_worker, NULL), 0);
+  pthread_join(producer, &ret_producer);
+  pthread_join(consumer, &ret_consumer);
+
+  ck_assert_msg(ret_producer == NULL, "Producer could not allocate");
+  ck_assert_msg(ret_consumer == NULL, "Consumer found a damaged block");
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
+
+/* Worker for the arena test, pinning itself leaves the other tests alone */
+static void *arena_worker(void *arg)
+{
+  void *a, *b, *blocks[64];
+  int n;
+
+  if (simple_mallopt(MM_OPT_THREAD_ARENA, 1) != 0) return (void *) 1;
+  a = MALLOC(1000);
+  if (simple_mallopt(MM_OPT_THREAD_ARENA, 2) != 0) return (void *) 1;
+  b = MALLOC(1000);
+  if (a == NULL || b == NULL) return (void *) 1;
+
+  FREE(a);  // Freed while attached to another arena
+  FREE(b);
+
+  // Much more than one arena holds, the rest has to come from the others
+  simple_mallopt(MM_OPT_THREAD_ARENA, 1);
+  for (n = 0; n < 64; n++) {
+    blocks[n] = MALLOC(100 * 1024);
+    if (blocks[n] == NULL) return (void *) 1;
+  }
+  for (n = 0; n < 64; n++) {
+    FREE(blocks[n]);
+  }
+  return NULL;
+}
+
+/**
+ * @name   Arena test
+ * @brief  Tests allocations spread over several arenas.
+ */
+START_TEST (test_arenas)
+{
+  pthread_t thread;
+  void *ret;
+
+  ck_assert_int_eq(simple_mallopt(MM_OPT_ARENAS, 0), 2);
+  ck_assert_int_eq(simple_mallopt(MM_OPT_ARENAS, 4), 0);
+  ck_assert_int_eq(simple_mallopt(MM_OPT_THREAD_ARENA, 4), 2);
+
+  ck_assert_int_eq(pthread_create(&thread, NULL, arena_worker, NULL), 0);
+  pthread_join(thread, &ret);
+  ck_assert_msg(ret == NULL, "Arena allocation failed");
+  ck_assert_int_eq(simple_heap_check(), 0);
+}
+END_TEST
 
 /**
  * @name   Example unit test suite.
@@ -278,13 +1361,43 @@ Suite* simple_malloc_suite()
   TCase *tc_core = tcase_create("Core tests");
   tcase_set_timeout(tc_core, 120);
   
-  // Strategy test
+  // Strategy tests
+  tcase_add_test(tc_core, test_segregated_fit);
   tcase_add_test(tc_core, test_non_first_fit);
+  tcase_add_test(tc_core, test_first_fit);
+  tcase_add_test(tc_core, test_policies);
 
   // Existing tests
   tcase_add_test(tc_core, test_simple_allocation);
   tcase_add_test(tc_core, test_simple_unique_addresses);
   tcase_add_test(tc_core, test_memory_exerciser);
+  tcase_add_test(tc_core, test_coalescing);
+#ifndef MM_BITMAP
+  tcase_add_test(tc_core, test_large_best_fit);
+#endif
+  tcase_add_test(tc_core, test_realloc);
+  tcase_add_test(tc_core, test_calloc);
+  tcase_add_test(tc_core, test_aligned_alloc);
+  tcase_add_test(tc_core, test_pool);
+  tcase_add_test(tc_core, test_region);
+  tcase_add_test(tc_core, test_handles);
+  tcase_add_test(tc_core, test_persist);
+  tcase_add_test(tc_core, test_heap_growth);
+  tcase_add_test(tc_core, test_trim);
+  tcase_add_test(tc_core, test_mmap);
+  tcase_add_test(tc_core, test_huge_pages);
+  tcase_add_test(tc_core, test_small_pages);
+#ifndef MM_BITMAP
+  tcase_add_test(tc_core, test_deferred_coalesce);
+#endif
+  tcase_add_test(tc_core, test_batch);
+  tcase_add_test(tc_core, test_free_sized);
+#ifdef MM_BITMAP
+  tcase_add_test(tc_core, test_bitmap);
+#endif
+  tcase_add_test(tc_core, test_threads);
+  tcase_add_test(tc_core, test_producer_consumer);
+  tcase_add_test(tc_core, test_arenas);
 
   suite_add_tcase(s, tc_core);
   return s;
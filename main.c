@@ -1,6 +1,7 @@
 /* You are not allowed to use <stdio.h> */
 #include <stdlib.h>
 #include "io.h"      // For read_char, write_char, write_string, write_int
+#include "mm.h"      // For simple_malloc, simple_realloc, simple_free_sized
 #include <string.h>
 
 typedef struct {
@@ -21,17 +22,9 @@ void init_collection(Collection *collection) {
 // Add an element to the collection
 void add_to_collection(Collection *collection, int value) {
     if (collection->size >= collection->capacity) {
-        // Allocate a new, larger array
+        // Grow the array, in place when the memory after it is free
         int new_capacity = collection->capacity * 2;
-        int *new_data = (int*)simple_malloc(new_capacity * sizeof(int));
-
-        // Copy the old data to the new array
-        for (int i = 0; i < collection->size; i++) {
-            new_data[i] = collection->data[i];
-        }
-
-        // Free the old data
-        simple_free(collection->data);
+        int *new_data = (int*)simple_realloc(collection->data, new_capacity * sizeof(int));
 
         // Update collection to use the new array
         collection->data = new_data;
@@ -67,7 +60,8 @@ void print_collection(Collection *collection) {
 // Free the dynamically allocated memory for the collection
 void 
 simple_free_collection(Collection *collection) {
-    simple_free(collection->data);  // Free the dynamically allocated memory
+    // Free the dynamically allocated memory, its size is known
+    simple_free_sized(collection->data, collection->capacity * sizeof(int));
 }
 
 /**
@@ -6,27 +6,204 @@
  * 
  */
 
+#define _GNU_SOURCE
+
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
 //#include "mm_aux.c"
 #include "mm.h"
 
 /* Proposed data structure elements */
 
 typedef struct header {
-  struct header * next;     // Bit 0 is used to indicate free block 
+  struct header * next;     // Bit 0 is used to indicate free block, bit 1 that the previous block is free
   uint64_t user_block[0];   // Standard trick: Empty array to make sure start of user block is aligned
 } BlockHeader;
 
 /* Macros to handle the free flag at bit 0 of the next pointer of header pointed at by p */
-#define GET_NEXT(p) (BlockHeader *)((uintptr_t)(p->next) & ~1)
-#define SET_NEXT(p, n) p->next = (BlockHeader *)((uintptr_t)(n) | ((uintptr_t)(p->next) & 1))
+#define FLAG_MASK (3)
+#define GET_NEXT(p) (BlockHeader *)((uintptr_t)(p->next) & ~FLAG_MASK)
+#define SET_NEXT(p, n) p->next = (BlockHeader *)((uintptr_t)(n) | ((uintptr_t)(p->next) & FLAG_MASK))
 #define GET_FREE(p) (uint8_t)((uintptr_t)(p->next) & 0x1)
 #define SET_FREE(p, f) p->next = (BlockHeader *)(((uintptr_t)(p->next) & ~1) | (f & 1))
 #define SIZE(p) (size_t)((uintptr_t)GET_NEXT(p) - (uintptr_t)(p + 1))
-#define MIN_SIZE (8)
+#define MIN_SIZE (3 * sizeof(void *))  // Free list links plus boundary tag
+
+/* Macros to handle the prev-free flag at bit 1, which tells that the block just below p is free */
+#define GET_PREV_FREE(p) (uint8_t)(((uintptr_t)(p->next) >> 1) & 0x1)
+#define SET_PREV_FREE(p, f) p->next = (BlockHeader *)(((uintptr_t)(p->next) & ~2) | ((f & 1) << 1))
+
+/* Blocks with a mapping of their own are marked with both flags set, which no
+ * block on the list can have since two free blocks are never next to each other */
+#define MMAPPED (3)
+#define IS_MMAPPED(p) (((uintptr_t)(p->next) & FLAG_MASK) == MMAPPED)
+
+/* Boundary tag: the last word of a free block holds a pointer back to its header */
+#define FOOTER(p) (((BlockHeader **)GET_NEXT(p))[-1])
+
+/* Explicit free list links, kept in the first two words of a free block */
+#define FREE_NEXT(p) (((BlockHeader **)((p) + 1))[0])
+#define FREE_PREV(p) (((BlockHeader **)((p) + 1))[1])
+
+/* Segregated size classes: exact classes in steps of 8 below SMALL_LIMIT,
+ * one class per power of two above it. Classes from LARGE_LIMIT and up
+ * hold a size trie instead of a list */
+#define SMALL_LIMIT     (512)
+#define LARGE_LIMIT     (4096)
+#define NUM_SMALL_BINS  ((int)((SMALL_LIMIT - MIN_SIZE) / 8))
+#define NUM_BINS        (NUM_SMALL_BINS + 64 - 9)
+#define FIRST_TREE_BIN  (NUM_SMALL_BINS + 3)  // Class of LARGE_LIMIT
+#define BIN_MAP_WORDS   ((NUM_BINS + 63) / 64)
+
+/* Size trie links of large free blocks, following the free list links. Blocks
+ * of equal size share one trie node and hang off it in a ring through the
+ * free list links; only the node itself has a parent (or is the root) */
+#define TREE_CHILD(p, d) (((BlockHeader **)((p) + 1))[2 + (d)])
+#define TREE_PARENT(p)   (((BlockHeader **)((p) + 1))[4])
+
+#ifndef MM_DEFAULT_POLICY
+#define MM_DEFAULT_POLICY MM_POLICY_BEST_FIT
+#endif
+
+/* Messages about the heap set up, left out with -DMM_QUIET where printf must not
+ * run inside the allocator, as in the preload library */
+#ifdef MM_QUIET
+#define init_message(...) ((void)0)
+#else
+#define init_message(...) printf(__VA_ARGS__)
+#endif
+
+/* Largest request taken, leaves room for rounding it up and the headers */
+#define MAX_REQUEST     (SIZE_MAX / 4)
+
+/* A range of blocks closed by a dummy block. The main arena starts out with
+ * memory_start to memory_end and maps more segments from the OS when it runs
+ * out. The dummy block of each segment points at the first block of the next,
+ * so the block list still runs through all of them. */
+typedef struct Segment {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t pristine;                  // Nothing above was handed out yet, see dirty_size
+    struct Segment *next;                // Mapped segments keep their header at their start
+} Segment;
+
+/* Arenas are independent heaps, each with its own block list, bins and lock.
+ * The main arena manages memory_start to memory_end; the others are carved
+ * out of it as blocks of ARENA_SIZE bytes when a CPU first needs one. */
+#define MAX_ARENAS      (16)
+#ifndef ARENA_SIZE
+#define ARENA_SIZE      (1024 * 1024)
+#endif
+
+/* Pages inside free blocks of at least TRIM_DEFAULT bytes are given back to
+ * the OS as the blocks are freed, see MM_OPT_TRIM_THRESHOLD. Free blocks that
+ * large were trimmed when they formed, so only the pages freed since are.
+ * MADV_FREE lets the kernel take them only when it needs them, so a block
+ * reused soon is not faulted in again. */
+#define TRIM_DEFAULT    (1024 * 1024)
+
+/* Huge page backing, see MM_OPT_HUGE_PAGES. Unless it is set before the heap
+ * is first used, the HUGE_PAGES_ENV environment variable selects it. */
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define HUGE_PAGES_ENV  "SIMPLE_MALLOC_HUGE_PAGES"
+
+/* Requests of at least MMAP_DEFAULT bytes get a mapping of their own and stay
+ * off the block list, see MM_OPT_MMAP_THRESHOLD */
+#define MMAP_DEFAULT    (1024 * 1024)
+#ifdef MADV_FREE
+#define TRIM_ADVICE     MADV_FREE
+#else
+#define TRIM_ADVICE     MADV_DONTNEED
+#endif
+
+typedef struct {
+    pthread_mutex_t lock;                // Protects everything but remote_free
+    BlockHeader *first;                  // Lowest block, the list is circular from here
+    BlockHeader *current;                // Where the next next-fit search starts
+    BlockHeader *bins[NUM_BINS];         // Heads of the free lists, or roots of the size tries
+    BlockHeader *quick[NUM_SMALL_BINS];  // Freed blocks waiting to be coalesced, see heap_release
+    uint64_t bin_map[BIN_MAP_WORDS];     // Bit set for every non-empty bin
+    BlockHeader *last;                   // Dummy block of the newest segment
+    Segment segment;                     // First segment, fixed once ready is set
+    atomic_int ready;
 
-BlockHeader *first = NULL;
-BlockHeader *current = NULL;
+    /* Blocks freed while another thread held the lock. Freeing threads push
+     * them without taking the lock; the next simple_malloc in this arena
+     * frees them all. Linked through the first payload word. */
+    _Atomic(BlockHeader *) remote_free;
+} Arena;
+
+static Arena arenas[MAX_ARENAS] = {
+    [0 ... MAX_ARENAS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+#define MAIN_ARENA (&arenas[0])
+
+static atomic_int num_arenas = 0;            // Arenas to spread CPUs over, 0 until first use
+static _Thread_local int thread_arena = -1;  // Arena of the calling thread, -1 until first use
+
+static atomic_int policy = MM_DEFAULT_POLICY;
+static atomic_size_t trim_threshold = TRIM_DEFAULT;
+static atomic_int deferred_coalesce = 0;
+static atomic_size_t mmap_threshold = MMAP_DEFAULT;
+static atomic_int huge_pages = -1;          // MM_HUGE_PAGES_ mode, -1 until first use
+static atomic_int remote_free_enabled = 1;
+
+/* Small objects, see MM_OPT_SMALL_PAGES. Each span of SPAN_SIZE bytes is a
+ * heap block aligned to its size that holds objects of one size class, with
+ * no header per object. Spans are found from an object address alone through
+ * a two level bitmap with one bit per SPAN_SIZE of address space. */
+#define SMALL_MAX       (64)                    // Largest object size served from spans
+#define SMALL_CLASSES   (SMALL_MAX / 8)
+#define SPAN_SHIFT      (16)
+#define SPAN_SIZE       ((size_t)1 << SPAN_SHIFT)
+#define SPAN_MAP_BITS   (16)                    // Index bits per level, for 48 bit addresses
+#define SPAN_MAP_WORDS  ((1 << SPAN_MAP_BITS) / 64)
+
+typedef struct Span {
+    struct Span *next;          // Spans of the class with free objects
+    struct Span *prev;
+    void *free_list;            // Freed objects, linked through their first word
+    uint8_t *bump;              // Next object never handed out
+    uint32_t obj_size;
+    uint32_t used;
+    uint32_t capacity;
+} Span;
+
+typedef struct {
+    pthread_mutex_t lock;
+    Span *partial;              // Spans with free objects
+} SmallClass;
+
+static SmallClass small_classes[SMALL_CLASSES] = {
+    [0 ... SMALL_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static _Atomic(_Atomic uint64_t *) span_map[1 << SPAN_MAP_BITS];
+static atomic_int small_pages = 0;      // Serve small requests from spans
+static atomic_long span_count = 0;      // Spans alive, simple_free only looks them up if any
+
+/* Per-thread caches of small allocated blocks, one stack per exact block
+ * size, linked through the first payload word. Cached blocks still count
+ * as allocated in the block list, so hits take no lock. */
+#define TCACHE_MAX      (256)   // Largest block size kept in the caches
+#define TCACHE_BINS     ((int)((TCACHE_MAX - MIN_SIZE) / 8 + 1))
+#define TCACHE_DEFAULT  (16)    // Blocks per size, see MM_OPT_THREAD_CACHE
+
+typedef struct {
+    BlockHeader *head[TCACHE_BINS];
+    uint16_t count[TCACHE_BINS];
+    uint8_t registered;         // Flushed by tcache_key at thread exit
+} ThreadCache;
+
+static _Thread_local ThreadCache tcache;
+static atomic_int tcache_limit = TCACHE_DEFAULT;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
 
 // Gets the next block in the list from the given block
 static BlockHeader *get_next_block(BlockHeader *block) {
@@ -43,9 +220,14 @@ static uint8_t is_block_free(BlockHeader *block) {
     return GET_FREE(block);
 }
 
-// Marks a block as free or allocated
+// Marks a block as free or allocated, keeping the boundary tag and the
+// prev-free flag of the following block up to date
 static void mark_block_free(BlockHeader *block, uint8_t free) {
     SET_FREE(block, free);
+    if (free) {
+        FOOTER(block) = block;
+    }
+    SET_PREV_FREE(get_next_block(block), free);
 }
 
 // Gets the size of the given block
@@ -53,119 +235,1453 @@ static size_t get_block_size(BlockHeader *block) {
     return SIZE(block);
 }
 
-// Finds the block that points to the given block
-static BlockHeader *find_previous_block(BlockHeader *block) {
-    BlockHeader *prev = first;
-    while (get_next_block(prev) != block && prev != NULL) {
-        prev = get_next_block(prev);
-        if (prev == first) break;
+// Finds the block that ends where the given block starts, using the boundary
+// tag of the previous block. Only valid when that block is free.
+static BlockHeader *find_previous_free_block(BlockHeader *block) {
+    if (!GET_PREV_FREE(block)) return NULL;
+    return ((BlockHeader **)block)[-1];
+}
+
+// Maps a block size to its size class
+static int bin_index(size_t size) {
+    if (size < SMALL_LIMIT) {
+        return (int)((size - MIN_SIZE) >> 3);
+    }
+    return NUM_SMALL_BINS + (63 - __builtin_clzll(size)) - 9;
+}
+
+// Sets or clears the bit for a size class in the bin map
+static void bin_mark(Arena *a, int i, int nonempty) {
+    if (nonempty) {
+        a->bin_map[i >> 6] |= (uint64_t)1 << (i & 63);
+    } else {
+        a->bin_map[i >> 6] &= ~((uint64_t)1 << (i & 63));
+    }
+}
+
+// Gets the size bits below the leading one, most significant first. They
+// select the path through the size trie of the class.
+static uint64_t tree_key(size_t size) {
+    return (uint64_t)size << (__builtin_clzll(size) + 1);
+}
+
+// Inserts a large free block in the size trie of its class
+static void tree_insert(Arena *a, BlockHeader *block, int i) {
+    size_t size = get_block_size(block);
+    uint64_t key = tree_key(size);
+    BlockHeader *t = a->bins[i];
+
+    TREE_CHILD(block, 0) = NULL;
+    TREE_CHILD(block, 1) = NULL;
+    FREE_NEXT(block) = block;
+    FREE_PREV(block) = block;
+
+    if (t == NULL) {
+        TREE_PARENT(block) = NULL;
+        a->bins[i] = block;
+        bin_mark(a, i, 1);
+        return;
+    }
+
+    for (;;) {
+        if (get_block_size(t) == size) {
+            // Same size as an existing node, join its ring
+            TREE_PARENT(block) = NULL;
+            FREE_NEXT(block) = FREE_NEXT(t);
+            FREE_PREV(block) = t;
+            FREE_PREV(FREE_NEXT(t)) = block;
+            FREE_NEXT(t) = block;
+            return;
+        }
+        BlockHeader **child = &TREE_CHILD(t, key >> 63);
+        key <<= 1;
+        if (*child == NULL) {
+            TREE_PARENT(block) = t;
+            *child = block;
+            return;
+        }
+        t = *child;
     }
-    return prev;
 }
 
+// Points whatever referred to the trie node old at replacement instead
+static void tree_replace(Arena *a, BlockHeader *old, BlockHeader *replacement, int i) {
+    BlockHeader *parent = TREE_PARENT(old);
+
+    if (parent == NULL) {
+        a->bins[i] = replacement;
+        if (replacement == NULL) bin_mark(a, i, 0);
+    } else if (TREE_CHILD(parent, 0) == old) {
+        TREE_CHILD(parent, 0) = replacement;
+    } else {
+        TREE_CHILD(parent, 1) = replacement;
+    }
+    if (replacement != NULL) TREE_PARENT(replacement) = parent;
+}
+
+// Unlinks a large free block from the size trie of its class
+static void tree_remove(Arena *a, BlockHeader *block, int i) {
+    BlockHeader *r;
+    int d;
+
+    if (FREE_NEXT(block) != block) {
+        // Other blocks of the same size, unlink from the ring
+        r = FREE_NEXT(block);
+        FREE_PREV(r) = FREE_PREV(block);
+        FREE_NEXT(FREE_PREV(block)) = r;
+        if (TREE_PARENT(block) == NULL && a->bins[i] != block) return;  // Not the trie node
+    } else {
+        // Last of its size, any leaf below can take its place in the trie
+        r = TREE_CHILD(block, 1) != NULL ? TREE_CHILD(block, 1) : TREE_CHILD(block, 0);
+        if (r == NULL) {
+            tree_replace(a, block, NULL, i);
+            return;
+        }
+        while (TREE_CHILD(r, 0) != NULL || TREE_CHILD(r, 1) != NULL) {
+            r = TREE_CHILD(r, 1) != NULL ? TREE_CHILD(r, 1) : TREE_CHILD(r, 0);
+        }
+        tree_replace(a, r, NULL, i);
+    }
+
+    for (d = 0; d < 2; d++) {
+        TREE_CHILD(r, d) = TREE_CHILD(block, d);
+        if (TREE_CHILD(r, d) != NULL) TREE_PARENT(TREE_CHILD(r, d)) = r;
+    }
+    tree_replace(a, block, r, i);
+}
+
+// Finds the smallest block in the subtrie below t
+static BlockHeader *tree_smallest(BlockHeader *t) {
+    BlockHeader *best = t;
+
+    while (t != NULL) {
+        if (get_block_size(t) < get_block_size(best)) best = t;
+        t = TREE_CHILD(t, 0) != NULL ? TREE_CHILD(t, 0) : TREE_CHILD(t, 1);
+    }
+    return best;
+}
+
+// Finds the best fit for size in the size trie of its class, or NULL. Walks
+// the path of size and remembers the last subtrie to the right of it; every
+// block in there is larger than size, so its smallest one is the fallback.
+static BlockHeader *tree_best_fit(Arena *a, size_t size, int i) {
+    uint64_t key = tree_key(size);
+    BlockHeader *t = a->bins[i];
+    BlockHeader *best = NULL;
+    BlockHeader *right = NULL;
+    size_t best_rest = SIZE_MAX;
+
+    while (t != NULL) {
+        size_t t_size = get_block_size(t);
+        if (t_size >= size && t_size - size < best_rest) {
+            best = t;
+            best_rest = t_size - size;
+            if (best_rest == 0) return best;
+        }
+        BlockHeader *r = TREE_CHILD(t, 1);
+        t = TREE_CHILD(t, key >> 63);
+        if (r != NULL && r != t) right = r;
+        key <<= 1;
+    }
+
+    if (right != NULL) {
+        right = tree_smallest(right);
+        if (best == NULL || get_block_size(right) < get_block_size(best)) best = right;
+    }
+    return best;
+}
+
+// Inserts a free block in its size class, at the head of the list for
+// small classes
+static void bin_insert(Arena *a, BlockHeader *block) {
+    int i = bin_index(get_block_size(block));
+
+    if (i >= FIRST_TREE_BIN) {
+        tree_insert(a, block, i);
+        return;
+    }
+
+    FREE_NEXT(block) = a->bins[i];
+    FREE_PREV(block) = NULL;
+    if (a->bins[i] != NULL) FREE_PREV(a->bins[i]) = block;
+    a->bins[i] = block;
+    bin_mark(a, i, 1);
+}
+
+// Unlinks a free block from its size class
+static void bin_remove(Arena *a, BlockHeader *block) {
+    int i = bin_index(get_block_size(block));
+
+    if (i >= FIRST_TREE_BIN) {
+        tree_remove(a, block, i);
+        return;
+    }
+
+    if (FREE_PREV(block) != NULL) {
+        FREE_NEXT(FREE_PREV(block)) = FREE_NEXT(block);
+    } else {
+        a->bins[i] = FREE_NEXT(block);
+        if (a->bins[i] == NULL) bin_mark(a, i, 0);
+    }
+    if (FREE_NEXT(block) != NULL) FREE_PREV(FREE_NEXT(block)) = FREE_PREV(block);
+}
+
+// Finds the first non-empty bin at or above the given index, or -1
+static int bin_next_nonempty(Arena *a, int i) {
+    int w = i >> 6;
+    uint64_t bits = a->bin_map[w] & (~(uint64_t)0 << (i & 63));
+
+    while (bits == 0) {
+        if (++w == BIN_MAP_WORDS) return -1;
+        bits = a->bin_map[w];
+    }
+    return (w << 6) + __builtin_ctzll(bits);
+}
+
+// Finds a free block of at least the given size. Small classes hold one size
+// only, so their head is an exact fit. The power of two lists are searched
+// for the first block that is large enough, the size tries for the best
+// fit. Every block in a higher class fits, and the smallest is taken.
+static BlockHeader *bin_find(Arena *a, size_t size) {
+    int i = bin_index(size);
+
+    if (i >= FIRST_TREE_BIN) {
+        BlockHeader *block = tree_best_fit(a, size, i);
+        if (block != NULL) return block;
+        i++;
+    } else if (i >= NUM_SMALL_BINS) {
+        BlockHeader *block;
+        for (block = a->bins[i]; block != NULL; block = FREE_NEXT(block)) {
+            if (get_block_size(block) >= size) return block;
+        }
+        i++;
+    }
+
+    if (i >= NUM_BINS) return NULL;
+    i = bin_next_nonempty(a, i);
+    if (i < 0) return NULL;
+    return i >= FIRST_TREE_BIN ? tree_smallest(a->bins[i]) : a->bins[i];
+}
+
+// Finds a free block of at least the given size by walking the list of all
+// blocks from start, which is first for first-fit and current for next-fit
+static BlockHeader *list_find(size_t size, BlockHeader *start) {
+    BlockHeader *block = start;
+
+    do {
+        if (is_block_free(block) && get_block_size(block) >= size) return block;
+        block = get_next_block(block);
+    } while (block != start);
+    return NULL;
+}
+
+// Finds a free block in bounded time: any block of a higher class fits, so
+// take the head of the first non-empty one. Only when there is none is the
+// own class searched.
+static BlockHeader *good_find(Arena *a, size_t size) {
+    int i = bin_index(size);
+    int j = i < NUM_SMALL_BINS ? i : i + 1;
+
+    if (j < NUM_BINS && (j = bin_next_nonempty(a, j)) >= 0) return a->bins[j];
+    return bin_find(a, size);
+}
+
+// Finds a free block of at least the given size with the current policy
+static BlockHeader *find_fit(Arena *a, size_t size) {
+    switch (atomic_load_explicit(&policy, memory_order_relaxed)) {
+    case MM_POLICY_FIRST_FIT: return list_find(size, a->first);
+    case MM_POLICY_NEXT_FIT:  return list_find(size, a->current);
+    case MM_POLICY_TLSF:      return good_find(a, size);
+    default:                  return bin_find(a, size);
+    }
+}
+
+// Marks a block free and files it in its size class
+static void insert_free_block(Arena *a, BlockHeader *block) {
+    mark_block_free(block, 1);
+    bin_insert(a, block);
+}
+
+// Lays out an empty arena over start to end: one free block and a dummy
+// allocated block at the end that points back to it
+static void arena_init(Arena *a, uintptr_t start, uintptr_t end) {
+    BlockHeader *first = (BlockHeader *)start;
+    BlockHeader *last = (BlockHeader *)(end - sizeof(BlockHeader));
+
+    last->next = first;  // Make it circular
+    SET_FREE(last, 0);   // Dummy block marked as allocated
+    first->next = last;
+    SET_PREV_FREE(first, 0);  // Nothing below the first block
+    insert_free_block(a, first);
+
+    a->first = first;
+    a->current = first;
+    a->last = last;
+    a->segment.start = start;
+    a->segment.end = end;
+    a->segment.pristine = start;
+    atomic_store_explicit(&a->ready, 1, memory_order_release);
+}
+
+// Gets the huge page mode, reading it from the environment on first use
+static int huge_pages_mode(void) {
+    int mode = atomic_load_explicit(&huge_pages, memory_order_relaxed);
+
+    if (mode < 0) {
+        const char *env = getenv(HUGE_PAGES_ENV);
+        int expected = -1;
+
+        mode = MM_HUGE_PAGES_OFF;
+        if (env != NULL && strcmp(env, "thp") == 0) mode = MM_HUGE_PAGES_THP;
+        if (env != NULL && strcmp(env, "hugetlb") == 0) mode = MM_HUGE_PAGES_HUGETLB;
+        if (!atomic_compare_exchange_strong(&huge_pages, &expected, mode)) mode = expected;
+    }
+    return mode;
+}
+
+// Asks for transparent huge pages on the huge page aligned part of a range
+static void advise_huge_pages(uintptr_t start, uintptr_t end) {
+#ifdef MADV_HUGEPAGE
+    start = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    end &= ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start) madvise((void *)start, end - start, MADV_HUGEPAGE);
+#endif
+}
+
+// Gets the size of the pages the heap is backed by
+static size_t heap_page_size(void) {
+    if (huge_pages_mode() != MM_HUGE_PAGES_OFF) return HUGE_PAGE_SIZE;
+    return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+// Maps memory for the heap, on huge pages if asked to. Rounds the length up
+// to whole pages.
+static void *map_pages(size_t *length) {
+    size_t page = heap_page_size();
+    void *mapped = MAP_FAILED;
+
+    *length = (*length + page - 1) & ~(page - 1);
+#ifdef MAP_HUGETLB
+    if (huge_pages_mode() == MM_HUGE_PAGES_HUGETLB) {
+        // Fails unless huge pages were reserved, then transparent ones are next best
+        mapped = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (mapped == MAP_FAILED) {
+        mapped = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped != MAP_FAILED && page == HUGE_PAGE_SIZE) {
+            advise_huge_pages((uintptr_t)mapped, (uintptr_t)mapped + *length);
+        }
+    }
+    return mapped;
+}
+
+// Initializes the main arena. Caller holds its lock.
 void simple_init() {
     uintptr_t aligned_memory_start = (memory_start + (sizeof(void*) - 1)) & ~(sizeof(void*) - 1);
     uintptr_t aligned_memory_end = memory_end & ~(sizeof(void*) - 1);
 
-    printf("Init: Aligned memory range: %p - %p\n", (void*)aligned_memory_start, (void*)aligned_memory_end);
+    init_message("Init: Aligned memory range: %p - %p\n", (void*)aligned_memory_start, (void*)aligned_memory_end);
 
-    if (first == NULL) {
+    if (MAIN_ARENA->first == NULL) {
         if (aligned_memory_start + 2 * sizeof(BlockHeader) + MIN_SIZE <= aligned_memory_end) {
-            first = (BlockHeader *)aligned_memory_start;
-            SET_FREE(first, 1);
-            BlockHeader *last = (BlockHeader *)(aligned_memory_end - sizeof(BlockHeader));
-            last->next = first;  // Make it circular
-            SET_FREE(last, 0);   // Dummy block marked as allocated
-            SET_NEXT(first, last);
-            current = first;
-
-            printf("Init: First block at %p, Last block at %p\n", first, last);
+            arena_init(MAIN_ARENA, aligned_memory_start, aligned_memory_end);
+            // The static memory cannot be mapped again, transparent huge pages still work on it
+            if (huge_pages_mode() != MM_HUGE_PAGES_OFF) advise_huge_pages(aligned_memory_start, aligned_memory_end);
+
+            init_message("Init: First block at %p, Last block at %p\n", MAIN_ARENA->first, (void *)(aligned_memory_end - sizeof(BlockHeader)));
         } else {
-            printf("Error: Not enough memory to initialize\n");
+            init_message("Error: Not enough memory to initialize\n");
         }
     }
 }
 
-void *simple_malloc(size_t size) {
-    if (first == NULL) {
+// Finds the segment of an arena that holds an address, or NULL if none does
+static Segment *segment_of(Arena *a, uintptr_t p) {
+    Segment *segment;
+
+    for (segment = &a->segment; segment != NULL; segment = segment->next) {
+        if (p >= segment->start && p < segment->end) return segment;
+    }
+    return NULL;
+}
+
+// Maps a new segment with room for a block of size bytes and links it in
+// after the last one. Caller holds the arena lock.
+static int arena_grow(Arena *a, size_t size) {
+    size_t length = sizeof(Segment) + 2 * sizeof(BlockHeader) + size;
+    size_t total = 0;
+    Segment *segment;
+
+    // At least double the heap, so it takes few segments to grow large and
+    // segment_of has few to look through
+    for (segment = &a->segment; segment != NULL; segment = segment->next) {
+        total += segment->end - segment->start;
+    }
+    if (length < total) length = total;
+
+    Segment *mapped = map_pages(&length);
+    if (mapped == MAP_FAILED) return 0;
+
+    mapped->start = (uintptr_t)(mapped + 1);
+    mapped->end = (uintptr_t)mapped + length;
+    mapped->pristine = mapped->start;  // Fresh pages are zero
+    mapped->next = NULL;
+    for (segment = &a->segment; segment->next != NULL; segment = segment->next) {}
+    segment->next = mapped;
+
+    BlockHeader *first = (BlockHeader *)mapped->start;
+    BlockHeader *last = (BlockHeader *)(mapped->end - sizeof(BlockHeader));
+
+    last->next = a->first;  // Allocated, closes the circle
+    first->next = last;     // Below the dummy block of the previous segment
+    set_next_block(a->last, first);
+    a->last = last;
+    insert_free_block(a, first);
+    return 1;
+}
+
+// Gives the pages from lo to hi inside a free block back to the OS, keeping its
+// header, free list words and boundary tag. Returns the number of bytes released.
+static size_t block_trim(BlockHeader *block, uintptr_t lo, uintptr_t hi, int advice) {
+    uintptr_t page = heap_page_size();  // Whole huge pages only, not to split them
+    uintptr_t head = (uintptr_t)(block + 1) + 5 * sizeof(void *);
+    uintptr_t tail = (uintptr_t)&FOOTER(block);
+    uintptr_t start = ((lo > head ? lo : head) + page - 1) & ~(page - 1);
+    uintptr_t end = (hi < tail ? hi : tail) & ~(page - 1);
+
+    if (end <= start) return 0;
+    if (madvise((void *)start, end - start, advice) != 0) {
+        // Kernels before 4.5 do not know MADV_FREE
+        if (advice == MADV_DONTNEED || madvise((void *)start, end - start, MADV_DONTNEED) != 0) return 0;
+    }
+    return end - start;
+}
+
+// Gives back the pages inside the blocks of a size trie of at least min_size bytes
+static size_t tree_trim(BlockHeader *t, size_t min_size, int advice) {
+    size_t released = 0;
+    BlockHeader *p;
+    int d;
+
+    if (t == NULL) return 0;
+
+    if (get_block_size(t) >= min_size) {
+        p = t;
+        do {
+            released += block_trim(p, (uintptr_t)p, (uintptr_t)get_next_block(p), advice);
+            p = FREE_NEXT(p);
+        } while (p != t);
+    }
+    for (d = 0; d < 2; d++) {
+        released += tree_trim(TREE_CHILD(t, d), min_size, advice);
+    }
+    return released;
+}
+
+// Gives back the pages inside the free blocks of an arena of at least min_size
+// bytes, for simple_trim. Smaller blocks hold no whole page. Caller holds the
+// arena lock.
+static size_t arena_trim(Arena *a, size_t min_size, int advice) {
+    size_t released = 0;
+    int i;
+
+    for (i = min_size > LARGE_LIMIT ? bin_index(min_size) : FIRST_TREE_BIN; i < NUM_BINS; i++) {
+        released += tree_trim(a->bins[i], min_size, advice);
+    }
+    return released;
+}
+
+// Frees an allocated block and coalesces it with its neighbours. Caller holds the arena lock.
+static void heap_free(Arena *a, BlockHeader *block);
+static void heap_release(Arena *a, BlockHeader *block);
+
+// Pushes a block on the remote free stack of an arena. Lock-free, any thread.
+static void remote_free_push(Arena *a, BlockHeader *block) {
+    BlockHeader *head = atomic_load_explicit(&a->remote_free, memory_order_relaxed);
+
+    do {
+        FREE_NEXT(block) = head;
+    } while (!atomic_compare_exchange_weak_explicit(&a->remote_free, &head, block,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+// Frees every block on the remote free stack. Caller holds the arena lock.
+static void remote_free_drain(Arena *a) {
+    if (atomic_load_explicit(&a->remote_free, memory_order_relaxed) == NULL) return;
+
+    // Take the whole stack at once, so pushes never race with a pop
+    BlockHeader *block = atomic_exchange_explicit(&a->remote_free, NULL, memory_order_acquire);
+    while (block != NULL) {
+        BlockHeader *next = FREE_NEXT(block);
+        heap_release(a, block);
+        block = next;
+    }
+}
+
+// Gets how many bytes at the start of a payload may not be zero. Above the
+// pristine mark only the header and free list words of the free block that
+// starts there were ever written, the memory is zero otherwise.
+static size_t dirty_size(uintptr_t pristine, uintptr_t payload, size_t size) {
+    uintptr_t limit = pristine + 6 * sizeof(void *);  // Header and trie node
+
+    if (payload >= limit) return 0;
+    return limit - payload < size ? limit - payload : size;
+}
+
+// Frees every block on the quick lists, merging it with its neighbours.
+// Returns 0 if there was none. Caller holds the arena lock.
+static int arena_coalesce(Arena *a) {
+    int merged = 0;
+    int i;
+
+    for (i = 0; i < NUM_SMALL_BINS; i++) {
+        while (a->quick[i] != NULL) {
+            BlockHeader *block = a->quick[i];
+            a->quick[i] = FREE_NEXT(block);
+            heap_free(a, block);
+            merged = 1;
+        }
+    }
+    return merged;
+}
+
+// Hands out an allocated block, keeping track of the memory that was used
+static void *heap_handout(Arena *a, BlockHeader *block, size_t *dirty) {
+    uintptr_t payload = (uintptr_t)(block + 1);
+    uintptr_t end = payload + get_block_size(block);
+    Segment *segment = segment_of(a, payload);
+
+    if (dirty != NULL) *dirty = dirty_size(segment->pristine, payload, get_block_size(block));
+    if (end > segment->pristine) segment->pristine = end;
+    return (void *)payload;
+}
+
+// Allocates a block with a payload of aligned_size bytes. If dirty is not
+// NULL it is set to the size of the payload prefix that may not be zero.
+// Caller holds the arena lock.
+static void *heap_malloc(Arena *a, size_t aligned_size, size_t *dirty) {
+    remote_free_drain(a);
+
+    if (a->first == NULL) {
+        if (a != MAIN_ARENA) return NULL;
         simple_init();
-        if (first == NULL) return NULL;
+        if (a->first == NULL) return NULL;
+    }
+
+    BlockHeader *block;
+    if (aligned_size < SMALL_LIMIT && (block = a->quick[bin_index(aligned_size)]) != NULL) {
+        // Coalescing was deferred, the block is still marked allocated
+        a->quick[bin_index(aligned_size)] = FREE_NEXT(block);
+        return heap_handout(a, block, dirty);
+    }
+
+    block = find_fit(a, aligned_size);
+    if (block == NULL && arena_coalesce(a)) block = find_fit(a, aligned_size);
+    if (block == NULL) {
+        // Only the main arena grows, the others fall back on it
+        if (a != MAIN_ARENA || !arena_grow(a, aligned_size)) return NULL;
+        block = find_fit(a, aligned_size);
+        if (block == NULL) return NULL; // No suitable block found
+    }
+
+    size_t block_size = get_block_size(block);
+    bin_remove(a, block);
+
+    if (block_size - aligned_size < sizeof(BlockHeader) + MIN_SIZE) {
+        mark_block_free(block, 0); // Use entire block
+    } else {
+        // Split block, the remainder goes back to its size class
+        BlockHeader *new_block = (BlockHeader *)((uintptr_t)block + sizeof(BlockHeader) + aligned_size);
+        new_block->next = get_next_block(block);
+        set_next_block(block, new_block);
+        mark_block_free(block, 0);
+        insert_free_block(a, new_block);
+    }
+
+    a->current = get_next_block(block);  // Next-fit continues after this block
+    return heap_handout(a, block, dirty);
+}
+
+static void heap_free(Arena *a, BlockHeader *block) {
+    if (is_block_free(block)) return;
+
+    SET_FREE(block, 1);
+
+    // Pages to give back if the block ends up large: its own, and those of free
+    // neighbours too small to have been trimmed when they were freed
+    size_t threshold = atomic_load_explicit(&trim_threshold, memory_order_relaxed);
+    uintptr_t lo = (uintptr_t)block;
+    uintptr_t hi = (uintptr_t)get_next_block(block);
+
+    BlockHeader *prev_block = find_previous_free_block(block);
+    BlockHeader *next_block = get_next_block(block);
+
+    // Coalesce with next block if it's free
+    if (is_block_free(next_block)) {
+        if (get_block_size(next_block) < threshold) hi = (uintptr_t)get_next_block(next_block);
+        bin_remove(a, next_block);
+        set_next_block(block, get_next_block(next_block));
+        if (a->current == next_block) a->current = block;
+    }
+
+    // Coalesce with previous block if it's free
+    if (prev_block != NULL) {
+        if (get_block_size(prev_block) < threshold) lo = (uintptr_t)prev_block;
+        bin_remove(a, prev_block);
+        set_next_block(prev_block, get_next_block(block));
+        if (a->current == block) a->current = prev_block;
+        block = prev_block;
+    }
+
+    insert_free_block(a, block);
+
+    // Nothing above the pristine mark was handed out, so it holds no pages yet
+    if (threshold != 0 && get_block_size(block) >= threshold) {
+        uintptr_t pristine = segment_of(a, lo)->pristine;
+        block_trim(block, lo, hi < pristine ? hi : pristine, TRIM_ADVICE);
+    }
+}
+
+// Frees a block the way the coalescing mode asks for: right away, or onto the
+// quick list of its size while coalescing is deferred. Caller holds the arena lock.
+static void heap_release(Arena *a, BlockHeader *block) {
+    size_t size = get_block_size(block);
+
+    if (size < SMALL_LIMIT && atomic_load_explicit(&deferred_coalesce, memory_order_relaxed)) {
+        int i = bin_index(size);
+        FREE_NEXT(block) = a->quick[i];
+        a->quick[i] = block;
+        return;
+    }
+    heap_free(a, block);
+}
+
+// Gets the number of arenas to spread CPUs over, one per CPU by default
+static int arena_count(void) {
+    int n = atomic_load_explicit(&num_arenas, memory_order_relaxed);
+
+    if (n == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int expected = 0;
+
+        n = cpus < 1 ? 1 : cpus > MAX_ARENAS ? MAX_ARENAS : (int)cpus;
+        if (!atomic_compare_exchange_strong(&num_arenas, &expected, n)) n = expected;
+    }
+    return n;
+}
+
+// Makes sure arena i is set up, carving it out of the main arena if needed.
+// Returns 0 if there is no room for it.
+static int arena_create(int i) {
+    Arena *a = &arenas[i];
+
+    if (i == 0 || atomic_load_explicit(&a->ready, memory_order_acquire)) return 1;
+
+    pthread_mutex_lock(&a->lock);
+    if (!atomic_load_explicit(&a->ready, memory_order_relaxed)) {
+        pthread_mutex_lock(&MAIN_ARENA->lock);
+        size_t dirty;
+        void *chunk = heap_malloc(MAIN_ARENA, ARENA_SIZE, &dirty);
+        pthread_mutex_unlock(&MAIN_ARENA->lock);
+
+        if (chunk != NULL) {
+            arena_init(a, (uintptr_t)chunk, (uintptr_t)chunk + ARENA_SIZE);
+            a->segment.pristine += dirty;  // The chunk may be recycled memory
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+    return atomic_load_explicit(&a->ready, memory_order_relaxed);
+}
+
+// Attaches the calling thread to the arena of the CPU it runs on
+static Arena *arena_pick(void) {
+    int cpu = sched_getcpu();
+    int i = (cpu < 0 ? 0 : cpu) % arena_count();
+
+    if (!arena_create(i)) i = 0;
+    thread_arena = i;
+    return &arenas[i];
+}
+
+// Finds the arena a block belongs to: the one whose range holds it, else main
+static Arena *arena_of(BlockHeader *block) {
+    int i;
+
+    for (i = 1; i < MAX_ARENAS; i++) {
+        Arena *a = &arenas[i];
+        if (atomic_load_explicit(&a->ready, memory_order_acquire) &&
+            (uintptr_t)block >= a->segment.start && (uintptr_t)block < a->segment.end) {
+            return a;
+        }
+    }
+    return MAIN_ARENA;
+}
+
+// Locks the arena that should serve a request from the calling thread
+static Arena *arena_lock(size_t aligned_size) {
+    Arena *a;
+
+    if (aligned_size >= ARENA_SIZE / 4) {
+        a = MAIN_ARENA;  // Large requests would not leave much of a CPU arena
+    } else {
+        a = thread_arena < 0 ? arena_pick() : &arenas[thread_arena];
+    }
+
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        // Contended, the thread may have moved to another CPU since it picked
+        if (a != MAIN_ARENA) a = arena_pick();
+        pthread_mutex_lock(&a->lock);
+    }
+    return a;
+}
+
+// Serves a request from the other arenas when the given one has run dry
+static void *arena_steal(Arena *tried, size_t aligned_size, size_t *dirty) {
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++) {
+        Arena *a = &arenas[i];
+        if (a == tried || (i > 0 && !atomic_load_explicit(&a->ready, memory_order_acquire))) continue;
+
+        pthread_mutex_lock(&a->lock);
+        void *result = heap_malloc(a, aligned_size, dirty);
+        pthread_mutex_unlock(&a->lock);
+        if (result != NULL) return result;
+    }
+    return NULL;
+}
+
+// Frees a block in the arena it belongs to
+static void arena_free(BlockHeader *block) {
+    Arena *a = arena_of(block);
+
+    pthread_mutex_lock(&a->lock);
+    heap_release(a, block);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Returns every block in a thread cache to its arena
+static void tcache_flush(ThreadCache *cache) {
+    int i;
+
+    for (i = 0; i < TCACHE_BINS; i++) {
+        while (cache->head[i] != NULL) {
+            BlockHeader *block = cache->head[i];
+            cache->head[i] = FREE_NEXT(block);
+            arena_free(block);
+        }
+        cache->count[i] = 0;
+    }
+}
+
+// Thread exit hook for the cache registered with tcache_key
+static void tcache_destroy(void *cache) {
+    tcache_flush(cache);
+}
+
+static void tcache_key_create(void) {
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+// Caches a block of the calling thread for requests of size bytes, or returns
+// 0 if the cache for that size is full. The block may be larger than size.
+static int tcache_push(BlockHeader *block, size_t size) {
+    int i = (int)((size - MIN_SIZE) >> 3);
+
+    if (tcache.count[i] >= atomic_load_explicit(&tcache_limit, memory_order_relaxed)) return 0;
+
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_key_create);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = 1;
     }
 
+    FREE_NEXT(block) = tcache.head[i];
+    tcache.head[i] = block;
+    tcache.count[i]++;
+    return 1;
+}
+
+// Caches a block of the calling thread, or returns 0 if it does not fit
+static int tcache_put(BlockHeader *block) {
+    // The header is read without the lock. Only the prev-free flag can change
+    // under us, and the size does not depend on it.
+    size_t size = get_block_size(block);
+
+    return size <= TCACHE_MAX && tcache_push(block, size);
+}
+
+// Checks if a request should get a mapping of its own
+static int use_mmap(size_t aligned_size) {
+    size_t threshold = atomic_load_explicit(&mmap_threshold, memory_order_relaxed);
+    return threshold != 0 && aligned_size >= threshold;
+}
+
+// Serves a request with a mapping of its own. The header points at the end
+// of the mapping, so the size works out as for any block.
+static void *mmap_malloc(size_t aligned_size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (sizeof(BlockHeader) + aligned_size + page - 1) & ~(page - 1);
+
+    BlockHeader *block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) return NULL;
+    if (huge_pages_mode() != MM_HUGE_PAGES_OFF) advise_huge_pages((uintptr_t)block, (uintptr_t)block + length);
+
+    block->next = (BlockHeader *)(((uintptr_t)block + length) | MMAPPED);
+    return (void *)(block + 1);
+}
+
+// Resizes a block with a mapping of its own, moving it if the kernel has to
+static void *mmap_realloc(BlockHeader *block, size_t aligned_size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t old_length = (uintptr_t)GET_NEXT(block) - (uintptr_t)block;
+    size_t length = (sizeof(BlockHeader) + aligned_size + page - 1) & ~(page - 1);
+
+    block = mremap(block, old_length, length, MREMAP_MAYMOVE);
+    if (block == MAP_FAILED) return NULL;
+
+    block->next = (BlockHeader *)(((uintptr_t)block + length) | MMAPPED);
+    return (void *)(block + 1);
+}
+
+// Allocates a block from the arena of the calling thread, or from the others
+// when it has no room. Sets dirty like heap_malloc.
+static void *arena_malloc(size_t aligned_size, size_t *dirty) {
+    Arena *a = arena_lock(aligned_size);
+    void *result = heap_malloc(a, aligned_size, dirty);
+    pthread_mutex_unlock(&a->lock);
+
+    if (result == NULL) result = arena_steal(a, aligned_size, dirty);
+    return result;
+}
+
+// Rounds a request up to a payload size a block can have
+static size_t align_request(size_t size) {
     size_t aligned_size = (size + (sizeof(void*) - 1)) & ~(sizeof(void*) - 1);
-    BlockHeader *search_start = current;
-    BlockHeader *next_block = get_next_block(current);
-
-    // Try to create a new block after current if there's enough space
-    if (next_block != first) {
-        size_t available_space = (uintptr_t)next_block - (uintptr_t)current - sizeof(BlockHeader);
-        if (available_space >= aligned_size + sizeof(BlockHeader)) {
-            // Create new block
-            BlockHeader *new_block = (BlockHeader *)((uintptr_t)current + sizeof(BlockHeader) + aligned_size);
-            set_next_block(new_block, next_block);
-            mark_block_free(new_block, 1);
-            set_next_block(current, new_block);
-            mark_block_free(current, 0);
-            void *result = (void *)(current + 1);
-            current = new_block;  // Move current to the new free block
-            return result;
+    if (aligned_size < MIN_SIZE) aligned_size = MIN_SIZE;  // Room for the free list links once freed
+    return aligned_size;
+}
+
+// Splits the part beyond size bytes off an allocated block and frees it, if
+// that part can hold a block of its own. Caller holds the arena lock.
+static void shrink_block(Arena *a, BlockHeader *block, size_t size) {
+    if (get_block_size(block) - size < sizeof(BlockHeader) + MIN_SIZE) return;
+
+    BlockHeader *tail = (BlockHeader *)((uintptr_t)block + sizeof(BlockHeader) + size);
+    tail->next = get_next_block(block);  // Allocated, below an allocated block
+    set_next_block(block, tail);
+    heap_free(a, tail);  // Merges it with a free block after it
+}
+
+// Sets or clears the bit of a span in the span map. Returns 0 if the
+// address is out of its reach or the map could not be extended.
+static int span_mark(Span *span, int used) {
+    uintptr_t index = (uintptr_t)span >> SPAN_SHIFT;
+    uintptr_t high = index >> SPAN_MAP_BITS;
+    uintptr_t low = index & ((1 << SPAN_MAP_BITS) - 1);
+
+    if (high >= (1 << SPAN_MAP_BITS)) return 0;
+
+    _Atomic uint64_t *bits = atomic_load_explicit(&span_map[high], memory_order_acquire);
+    if (bits == NULL) {
+        _Atomic uint64_t *expected = NULL;
+
+        bits = mmap(NULL, SPAN_MAP_WORDS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (bits == MAP_FAILED) return 0;
+        if (!atomic_compare_exchange_strong(&span_map[high], &expected, bits)) {
+            munmap((void *)bits, SPAN_MAP_WORDS * sizeof(uint64_t));
+            bits = expected;
         }
     }
 
-    // If we can't create a new block, try to find an existing free block
-    do {
-        if (is_block_free(current) && get_block_size(current) >= aligned_size) {
-            size_t block_size = get_block_size(current);
-            BlockHeader *next = get_next_block(current);
-
-            if (block_size - aligned_size < sizeof(BlockHeader) + MIN_SIZE) {
-                mark_block_free(current, 0); // Use entire block
-            } else {
-                // Split block
-                BlockHeader *new_block = (BlockHeader *)((uintptr_t)current + sizeof(BlockHeader) + aligned_size);
-                set_next_block(new_block, next);
-                mark_block_free(new_block, 1);
-                set_next_block(current, new_block);
-                mark_block_free(current, 0);
-            }
+    if (used) {
+        atomic_fetch_or(&bits[low >> 6], (uint64_t)1 << (low & 63));
+    } else {
+        atomic_fetch_and(&bits[low >> 6], ~((uint64_t)1 << (low & 63)));
+    }
+    return 1;
+}
 
-            void *result = (void *)(current + 1);
-            current = get_next_block(current);
-            return result;
+// Finds the span an object belongs to, or NULL if it is not in one
+static Span *span_of(void *ptr) {
+    uintptr_t index = (uintptr_t)ptr >> SPAN_SHIFT;
+    uintptr_t high = index >> SPAN_MAP_BITS;
+    uintptr_t low = index & ((1 << SPAN_MAP_BITS) - 1);
+
+    if (high >= (1 << SPAN_MAP_BITS)) return NULL;
+
+    _Atomic uint64_t *bits = atomic_load_explicit(&span_map[high], memory_order_acquire);
+    if (bits == NULL || !((atomic_load_explicit(&bits[low >> 6], memory_order_relaxed) >> (low & 63)) & 1)) {
+        return NULL;
+    }
+    return (Span *)((uintptr_t)ptr & ~(SPAN_SIZE - 1));
+}
+
+// Takes a span off the list of spans of its class with free objects
+static void span_unlink(SmallClass *c, Span *span) {
+    if (span->prev != NULL) span->prev->next = span->next;
+    else c->partial = span->next;
+    if (span->next != NULL) span->next->prev = span->prev;
+}
+
+// Puts a span on the list of spans of its class with free objects
+static void span_link(SmallClass *c, Span *span) {
+    span->prev = NULL;
+    span->next = c->partial;
+    if (c->partial != NULL) c->partial->prev = span;
+    c->partial = span;
+}
+
+// Gets a new span for objects of obj_size bytes from the heap
+static Span *span_create(uint32_t obj_size) {
+    Span *span = simple_aligned_alloc(SPAN_SIZE, SPAN_SIZE - sizeof(BlockHeader));
+    if (span == NULL) return NULL;
+
+    if (!span_mark(span, 1)) {
+        simple_free(span);
+        return NULL;
+    }
+    span->free_list = NULL;
+    span->bump = (uint8_t *)(span + 1);
+    span->obj_size = obj_size;
+    span->used = 0;
+    span->capacity = (uint32_t)((SPAN_SIZE - sizeof(BlockHeader) - sizeof(Span)) / obj_size);
+    atomic_fetch_add(&span_count, 1);
+    return span;
+}
+
+// Allocates an object of at most SMALL_MAX bytes from a span of its class
+static void *small_malloc(size_t aligned_size) {
+    SmallClass *c = &small_classes[aligned_size / 8 - 1];
+    void *obj;
+
+    pthread_mutex_lock(&c->lock);
+    Span *span = c->partial;
+    if (span == NULL) {
+        span = span_create((uint32_t)aligned_size);
+        if (span == NULL) {
+            pthread_mutex_unlock(&c->lock);
+            return NULL;
         }
-        current = get_next_block(current);
-    } while (current != search_start);
+        span_link(c, span);
+    }
 
-    return NULL; // No suitable block found
+    if (span->free_list != NULL) {
+        obj = span->free_list;
+        span->free_list = *(void **)obj;
+    } else {
+        obj = span->bump;
+        span->bump += span->obj_size;
+    }
+    if (++span->used == span->capacity) span_unlink(c, span);
+    pthread_mutex_unlock(&c->lock);
+    return obj;
+}
+
+// Returns an object to its span. A span left empty goes back to the heap,
+// unless it is the last one of its class with free objects.
+static void small_free(Span *span, void *obj) {
+    SmallClass *c = &small_classes[span->obj_size / 8 - 1];
+
+    pthread_mutex_lock(&c->lock);
+    *(void **)obj = span->free_list;
+    span->free_list = obj;
+    if (span->used-- == span->capacity) span_link(c, span);
+
+    if (span->used == 0 && (c->partial != span || span->next != NULL)) {
+        span_unlink(c, span);
+        span_mark(span, 0);
+        atomic_fetch_sub(&span_count, 1);
+        simple_free(span);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void *simple_malloc(size_t size) {
+    if (size > MAX_REQUEST) return NULL;  // Also guards the rounding below
+
+    size_t aligned_size = align_request(size);
+
+    if (size <= SMALL_MAX && atomic_load_explicit(&small_pages, memory_order_relaxed)) {
+        void *result = small_malloc(size == 0 ? 8 : (size + 7) & ~(size_t)7);
+        if (result != NULL) return result;
+    }
+
+    // Fast path: a cached block of exactly this size
+    if (aligned_size <= TCACHE_MAX) {
+        int i = (int)((aligned_size - MIN_SIZE) >> 3);
+        BlockHeader *block = tcache.head[i];
+        if (block != NULL) {
+            tcache.head[i] = FREE_NEXT(block);
+            tcache.count[i]--;
+            return (void *)(block + 1);
+        }
+    }
+
+    if (use_mmap(aligned_size)) {
+        void *result = mmap_malloc(aligned_size);
+        if (result != NULL) return result;
+    }
+    return arena_malloc(aligned_size, NULL);
+}
+
+void *simple_calloc(size_t count, size_t size) {
+    size_t total;
+    size_t dirty;
+
+    if (__builtin_mul_overflow(count, size, &total) || total > MAX_REQUEST) return NULL;
+
+    size_t aligned_size = align_request(total);
+    uint8_t *result;
+
+    // Cached blocks are recycled, and small enough to clear in full
+    if (aligned_size <= TCACHE_MAX) {
+        result = simple_malloc(total);
+        if (result != NULL) memset(result, 0, total);
+        return result;
+    }
+
+    // Fresh pages are zero
+    if (use_mmap(aligned_size) && (result = mmap_malloc(aligned_size)) != NULL) return result;
+
+    result = arena_malloc(aligned_size, &dirty);
+    if (result == NULL) return NULL;
+
+    memset(result, 0, dirty);
+    // The last word may have held the boundary tag of a free block
+    size_t tag = get_block_size((BlockHeader *)result - 1) - sizeof(void *);
+    if (tag < total) memset(result + tag, 0, total - tag);
+    return result;
+}
+
+// Frees a block of the heap to its arena, or leaves it to the thread busy in it
+static void heap_free_block(BlockHeader *block) {
+    Arena *a = arena_of(block);
+
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        if (atomic_load_explicit(&remote_free_enabled, memory_order_relaxed)) {
+            remote_free_push(a, block);
+            return;
+        }
+        pthread_mutex_lock(&a->lock);
+    }
+    heap_release(a, block);
+    pthread_mutex_unlock(&a->lock);
 }
 
 void simple_free(void *ptr) {
     if (ptr == NULL) return;
 
+    if (atomic_load_explicit(&span_count, memory_order_relaxed) != 0) {
+        Span *span = span_of(ptr);
+        if (span != NULL) {
+            small_free(span, ptr);
+            return;
+        }
+    }
+
     BlockHeader *block = (BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader));
-    if (is_block_free(block)) return;
+    if (IS_MMAPPED(block)) {
+        munmap(block, (uintptr_t)GET_NEXT(block) - (uintptr_t)block);
+        return;
+    }
+    if (tcache_put(block)) return;
+    heap_free_block(block);
+}
+
+void simple_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) return;
 
-    // Move current pointer past the block being freed
-    if (current == block) {
-        current = get_next_block(block);
+#ifdef MM_DEBUG
+    // A span object given a larger size would be taken for a block below
+    if (size > SMALL_MAX && atomic_load_explicit(&span_count, memory_order_relaxed) != 0 && span_of(ptr) != NULL) {
+        abort();
     }
+#endif
 
-    mark_block_free(block, 1);
+    // Only requests up to SMALL_MAX bytes can have come from a span
+    if (size <= SMALL_MAX && atomic_load_explicit(&span_count, memory_order_relaxed) != 0) {
+        Span *span = span_of(ptr);
+        if (span != NULL) {
+#ifdef MM_DEBUG
+            if (size > span->obj_size) abort();
+#endif
+            small_free(span, ptr);
+            return;
+        }
+    }
 
-    // Find previous block
-    BlockHeader *prev_block = find_previous_block(block);
-    BlockHeader *next_block = get_next_block(block);
+    BlockHeader *block = (BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader));
+    size_t aligned_size = align_request(size);
 
-    // Coalesce with previous block if it's free
-    if (prev_block != NULL && prev_block != block && is_block_free(prev_block)) {
-        set_next_block(prev_block, get_next_block(block));
-        block = prev_block;
+#ifdef MM_DEBUG
+    if (size > MAX_REQUEST || (is_block_free(block) && !IS_MMAPPED(block)) || aligned_size > get_block_size(block)) {
+        abort();  // Freed twice, or not the size it was allocated with
     }
+#endif
+    if (IS_MMAPPED(block)) {
+        munmap(block, (uintptr_t)GET_NEXT(block) - (uintptr_t)block);
+        return;
+    }
+    // The block holds at least the request, so it can serve one of that size
+    if (aligned_size <= TCACHE_MAX && tcache_push(block, aligned_size)) return;
+    heap_free_block(block);
+}
 
-    // Coalesce with next block if it's free
-    if (next_block != first && is_block_free(next_block)) {
-        set_next_block(block, get_next_block(next_block));
+size_t simple_malloc_batch(size_t size, size_t n, void **out) {
+    if (size > MAX_REQUEST) return 0;
+
+    size_t aligned_size = align_request(size);
+    size_t stride = sizeof(BlockHeader) + aligned_size;
+    size_t done = 0;
+    size_t count = n;
+
+    // Objects that do not live on the list are taken one by one
+    if ((size <= SMALL_MAX && atomic_load_explicit(&small_pages, memory_order_relaxed)) || use_mmap(aligned_size)) {
+        while (done < n && (out[done] = simple_malloc(size)) != NULL) done++;
+        return done;
+    }
+
+    while (done < n) {
+        if (count > n - done) count = n - done;
+        if (count > MAX_REQUEST / stride) count = MAX_REQUEST / stride;
+
+        // One block for the whole run, split into objects in one pass
+        uint8_t *run = arena_malloc(count * stride - sizeof(BlockHeader), NULL);
+        if (run == NULL) {
+            if (count == 1) break;
+            count /= 2;  // No free block that large, try smaller runs
+            continue;
+        }
+
+        BlockHeader *block = (BlockHeader *)run - 1;
+        BlockHeader *end = get_next_block(block);
+        Arena *a = arena_of(block);
+        size_t i;
+
+        pthread_mutex_lock(&a->lock);  // Keeps list walks off the half split run
+        for (i = 0; i < count; i++) {
+            BlockHeader *next = i + 1 < count ? (BlockHeader *)((uint8_t *)block + stride) : end;
+            if (i > 0) block->next = NULL;  // Allocated, below an allocated block
+            set_next_block(block, next);
+            out[done++] = (void *)(block + 1);
+            block = next;
+        }
+        pthread_mutex_unlock(&a->lock);
     }
+    return done;
+}
+
+// Orders pointers by address
+static int compare_addresses(const void *x, const void *y) {
+    uintptr_t p = (uintptr_t)*(void * const *)x;
+    uintptr_t q = (uintptr_t)*(void * const *)y;
+
+    return p < q ? -1 : p > q;
+}
+
+void simple_free_batch(void **ptrs, size_t n) {
+    Arena *a = NULL;
+    size_t i = 0;
+
+    qsort(ptrs, n, sizeof(void *), compare_addresses);
+
+    while (i < n) {
+        void *ptr = ptrs[i++];
+        if (ptr == NULL) continue;
+
+        BlockHeader *block = (BlockHeader *)ptr - 1;
+        if ((atomic_load_explicit(&span_count, memory_order_relaxed) != 0 && span_of(ptr) != NULL) ||
+            IS_MMAPPED(block)) {
+            // Freeing a span object can take span and arena locks of its own
+            if (a != NULL) {
+                pthread_mutex_unlock(&a->lock);
+                a = NULL;
+            }
+            simple_free(ptr);
+            continue;
+        }
+
+        // Keep the arena locked over a stretch of its blocks
+        Arena *owner = arena_of(block);
+        if (owner != a) {
+            if (a != NULL) pthread_mutex_unlock(&a->lock);
+            a = owner;
+            pthread_mutex_lock(&a->lock);
+        }
+
+        // Merge the run of blocks that follow each other into one, so it is
+        // freed and coalesced with its neighbours once
+        while (i < n && ptrs[i] == (void *)(get_next_block(block) + 1)) {
+            BlockHeader *next = get_next_block(block);
+            set_next_block(block, get_next_block(next));
+            if (a->current == next) a->current = block;
+            i++;
+        }
+        heap_release(a, block);
+    }
+    if (a != NULL) pthread_mutex_unlock(&a->lock);
+}
+
+void *simple_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+    if (alignment <= sizeof(void *)) return simple_malloc(size);
+    if (size > MAX_REQUEST || alignment > MAX_REQUEST) return NULL;
+
+    size_t aligned_size = align_request(size);
+
+    // Fast path: a cached block that is aligned already. Blocks from here keep a
+    // tail too small to split off, so they are cached a few sizes up.
+    if (aligned_size <= TCACHE_MAX) {
+        int i = (int)((aligned_size - MIN_SIZE) >> 3);
+        int last = i + (int)((sizeof(BlockHeader) + MIN_SIZE) >> 3);
+
+        for (; i < TCACHE_BINS && i < last; i++) {
+            BlockHeader *block = tcache.head[i];
+            if (block != NULL && ((uintptr_t)(block + 1) & (alignment - 1)) == 0) {
+                tcache.head[i] = FREE_NEXT(block);
+                tcache.count[i]--;
+                return (void *)(block + 1);
+            }
+        }
+    }
+
+    // Room to move the payload up to the alignment with a whole free block before it
+    uint8_t *ptr = arena_malloc(aligned_size + alignment + sizeof(BlockHeader) + MIN_SIZE, NULL);
+    if (ptr == NULL) return NULL;
+
+    BlockHeader *block = (BlockHeader *)ptr - 1;
+    Arena *a = arena_of(block);
+    uintptr_t payload = ((uintptr_t)ptr + alignment - 1) & ~(alignment - 1);
+
+    pthread_mutex_lock(&a->lock);
+    if (payload != (uintptr_t)ptr) {
+        while (payload - (uintptr_t)ptr < sizeof(BlockHeader) + MIN_SIZE) payload += alignment;
+
+        // Give the padding back as a block of its own
+        BlockHeader *aligned = (BlockHeader *)payload - 1;
+        aligned->next = get_next_block(block);  // Allocated, below an allocated block
+        set_next_block(block, aligned);
+        heap_free(a, block);
+        block = aligned;
+    }
+    shrink_block(a, block, aligned_size);
+    pthread_mutex_unlock(&a->lock);
+    return (void *)payload;
+}
+
+void *simple_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return simple_malloc(size);
+    if (size == 0) {
+        simple_free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST) return NULL;
+
+    Span *span = atomic_load_explicit(&span_count, memory_order_relaxed) != 0 ? span_of(ptr) : NULL;
+    if (span != NULL) {
+        if (size <= span->obj_size) return ptr;
+
+        void *result = simple_malloc(size);
+        if (result != NULL) {
+            memcpy(result, ptr, span->obj_size);
+            simple_free(ptr);
+        }
+        return result;
+    }
+
+    BlockHeader *block = (BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader));
+    size_t old_size = get_block_size(block);
+    size_t aligned_size = align_request(size);
+
+    if (IS_MMAPPED(block)) {
+        if (use_mmap(aligned_size)) return mmap_realloc(block, aligned_size);
+
+        // Small enough again to live on the list
+        void *result = simple_malloc(size);
+        if (result != NULL) {
+            memcpy(result, ptr, size < old_size ? size : old_size);
+            simple_free(ptr);
+        }
+        return result;
+    }
+
+    Arena *a = arena_of(block);
+
+    pthread_mutex_lock(&a->lock);
+    remote_free_drain(a);  // May free the block after this one
+
+    if (aligned_size > old_size) {
+        // Grow into the next block if it is free and large enough
+        BlockHeader *next = get_next_block(block);
+        if (!is_block_free(next) || old_size + sizeof(BlockHeader) + get_block_size(next) < aligned_size) {
+            pthread_mutex_unlock(&a->lock);
+
+            void *result = simple_malloc(size);
+            if (result != NULL) {
+                memcpy(result, ptr, old_size);
+                simple_free(ptr);
+            }
+            return result;
+        }
+
+        bin_remove(a, next);
+        set_next_block(block, get_next_block(next));
+        SET_PREV_FREE(get_next_block(block), 0);
+        if (a->current == next) a->current = block;
+
+        uintptr_t end = (uintptr_t)ptr + aligned_size;
+        Segment *segment = segment_of(a, end - 1);
+        if (end > segment->pristine) segment->pristine = end;
+    }
+
+    shrink_block(a, block, aligned_size);
+    pthread_mutex_unlock(&a->lock);
+    return ptr;
+}
+
+size_t simple_usable_size(void *ptr) {
+    if (ptr == NULL) return 0;
+
+    if (atomic_load_explicit(&span_count, memory_order_relaxed) != 0) {
+        Span *span = span_of(ptr);
+        if (span != NULL) return span->obj_size;
+    }
+    // Mapped blocks have their size worked out like any other
+    return get_block_size((BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader)));
+}
+
+// Moves an allocated block down into the free block right below it. The free
+// space ends up above the block, merged with what is free there. Caller holds
+// the arena lock.
+static BlockHeader *heap_slide(Arena *a, BlockHeader *block) {
+    BlockHeader *prev = find_previous_free_block(block);
+    if (prev == NULL) return block;
+
+    size_t size = get_block_size(block);
+    BlockHeader *next = get_next_block(block);
+
+    bin_remove(a, prev);
+    memmove(prev + 1, block + 1, size);
+    SET_FREE(prev, 0);  // Keeps the prev-free flag, the block below is never free
+
+    BlockHeader *gap = (BlockHeader *)((uintptr_t)(prev + 1) + size);
+    set_next_block(prev, gap);
+    gap->next = NULL;  // Allocated, below the moved block
+    set_next_block(gap, next);
+    if (a->current == block) a->current = prev;
+    heap_free(a, gap);
+    return prev;
+}
+
+void *simple_slide(void *ptr) {
+    if (ptr == NULL) return NULL;
+    if (atomic_load_explicit(&span_count, memory_order_relaxed) != 0 && span_of(ptr) != NULL) return ptr;
+
+    BlockHeader *block = (BlockHeader *)((uintptr_t)ptr - sizeof(BlockHeader));
+    if (IS_MMAPPED(block)) return ptr;
+
+    Arena *a = arena_of(block);
+    pthread_mutex_lock(&a->lock);
+    block = heap_slide(a, block);
+    pthread_mutex_unlock(&a->lock);
+    return (void *)(block + 1);
+}
+
+size_t simple_trim(void) {
+    size_t released = 0;
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++) {
+        Arena *a = &arenas[i];
+        if (!atomic_load_explicit(&a->ready, memory_order_acquire)) continue;
+
+        pthread_mutex_lock(&a->lock);
+        remote_free_drain(a);
+        arena_coalesce(a);
+        released += arena_trim(a, 0, MADV_DONTNEED);
+        pthread_mutex_unlock(&a->lock);
+    }
+    return released;
+}
+
+void simple_coalesce(void) {
+    int i;
+
+    for (i = 0; i < MAX_ARENAS; i++) {
+        Arena *a = &arenas[i];
+        if (!atomic_load_explicit(&a->ready, memory_order_acquire)) continue;
+
+        pthread_mutex_lock(&a->lock);
+        remote_free_drain(a);
+        arena_coalesce(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+int simple_mallopt(int param, long value) {
+    int ret = 0;
+
+    switch (param) {
+    case MM_OPT_POLICY:
+        if (value < MM_POLICY_FIRST_FIT || value > MM_POLICY_TLSF) return 2;
+        atomic_store(&policy, (int)value);
+        break;
+    case MM_OPT_REMOTE_FREE:
+        atomic_store(&remote_free_enabled, value != 0);
+        break;
+    case MM_OPT_THREAD_CACHE:
+        if (value < 0 || value > UINT16_MAX) return 2;
+        atomic_store(&tcache_limit, (int)value);
+        tcache_flush(&tcache);
+        break;
+    case MM_OPT_ARENAS:
+        if (value < 1 || value > MAX_ARENAS) return 2;
+        atomic_store(&num_arenas, (int)value);
+        thread_arena = -1;
+        break;
+    case MM_OPT_TRIM_THRESHOLD:
+        if (value < 0) return 2;
+        atomic_store(&trim_threshold, (size_t)value);
+        break;
+    case MM_OPT_MMAP_THRESHOLD:
+        if (value < 0) return 2;
+        atomic_store(&mmap_threshold, (size_t)value);
+        break;
+    case MM_OPT_HUGE_PAGES:
+        if (value < MM_HUGE_PAGES_OFF || value > MM_HUGE_PAGES_HUGETLB) return 2;
+        atomic_store(&huge_pages, (int)value);
+
+        // Memory the heap already has can still get transparent huge pages
+        if (value != MM_HUGE_PAGES_OFF) {
+            Segment *segment;
+            pthread_mutex_lock(&MAIN_ARENA->lock);
+            if (atomic_load(&MAIN_ARENA->ready)) {
+                for (segment = &MAIN_ARENA->segment; segment != NULL; segment = segment->next) {
+                    advise_huge_pages(segment->start, segment->end);
+                }
+            }
+            pthread_mutex_unlock(&MAIN_ARENA->lock);
+        }
+        break;
+    case MM_OPT_DEFERRED_COALESCE:
+        atomic_store(&deferred_coalesce, value != 0);
+        if (value == 0) simple_coalesce();
+        break;
+    case MM_OPT_SMALL_PAGES:
+        atomic_store(&small_pages, value != 0);
+        break;
+    case MM_OPT_THREAD_ARENA:
+        if (value < 0 || value >= arena_count()) return 2;
+        if (!arena_create((int)value)) return 3;
+        thread_arena = (int)value;
+        break;
+    default:
+        ret = 1;
+    }
+    return ret;
 }
 
 /* Include test routines */
@@ -173,7 +1689,7 @@ void simple_free(void *ptr) {
 int simple_macro_test() {
   BlockHeader block;
   BlockHeader * p = &block;
-  void * addr[2] = { (void *)  0x1234BABA, (void *) 0xFEDCBA981234BABA };
+  void * addr[2] = { (void *)  0x1234BAB8, (void *) 0xFEDCBA981234BAB8 };  /* Headers are word aligned */
   int i;
   int ret = 0;
 
@@ -206,6 +1722,16 @@ int simple_macro_test() {
     /* Check size for backward next pointer (dummy block) */
     SET_NEXT(p, (void *) ((uintptr_t) p + sizeof(BlockHeader) - 0x100 ) );
     if (SIZE(p) != 0 && SIZE(p) < 0x800000000000000 )   return 7 + i*10;
+
+    /* Check that prev-free is separated from next and free */
+    SET_NEXT(p, addr[i]);
+    SET_FREE(p, 1);
+    SET_PREV_FREE(p, 1);
+    if (GET_PREV_FREE(p) != 1 || GET_FREE(p) != 1) return 8 + i*10;  // Flags mixed up
+    if (GET_NEXT(p) != addr[i]) return 9 + i*10;                     // Next pointer damaged
+
+    SET_PREV_FREE(p, 0);
+    if (GET_PREV_FREE(p) != 0 || GET_FREE(p) != 1) return 10 + i*10; // Prev-free flag not cleared
   
   }
   return ret;
@@ -221,21 +1747,161 @@ static void print_block(BlockHeader * p) {
  */
 void simple_block_dump(void) {
   BlockHeader * p;
+  int i;
 
-  if (first == NULL) {
+  if (MAIN_ARENA->first == NULL) {
     printf("Data structure is not initialized\n");
     return;
   }
 
-  printf("first = 0x%08lx, current = 0x%08lx\n", (uintptr_t) first, (uintptr_t) current);
+  for (i = 0; i < MAX_ARENAS; i++) {
+    Arena * a = &arenas[i];
+    if (!atomic_load(&a->ready)) continue;
+
+    pthread_mutex_lock(&a->lock);
+    printf("arena %d: first = 0x%08lx, current = 0x%08lx\n", i, (uintptr_t) a->first, (uintptr_t) a->current);
+
+    p = a->first;
+
+    do {
+      if (segment_of(a, (uintptr_t) p) == NULL) {
+        printf("Block pointer 0x%08lx out of range\n", (uintptr_t) p);
+        break;
+      }
+      p = GET_NEXT(p);
+    } while (p != a->first);
+    pthread_mutex_unlock(&a->lock);
+  }
+}
+
+/* Verifies the size trie below t and counts the blocks in it */
+static int tree_check(BlockHeader * t, BlockHeader * parent, int i, size_t * count) {
+  BlockHeader * p;
+  int d, ret;
+
+  if (t == NULL) return 0;
+  if (TREE_PARENT(t) != parent)                                   return 11;  // Trie links damaged
+
+  p = t;
+  do {
+    if (!GET_FREE(p))                                             return 7;   // Allocated block in a bin
+    if (bin_index(SIZE(p)) != i || SIZE(p) != SIZE(t))            return 8;   // Block in the wrong bin
+    if (FREE_PREV(FREE_NEXT(p)) != p)                             return 9;   // Free list links damaged
+    (*count)++;
+    p = FREE_NEXT(p);
+  } while (p != t);
+
+  for (d = 0; d < 2; d++) {
+    ret = tree_check(TREE_CHILD(t, d), t, i, count);
+    if (ret) return ret;
+  }
+  return 0;
+}
+
+/* Verifies the block list and the bins of an arena. Caller holds its lock. */
+static int heap_check(Arena * a) {
+  BlockHeader * p;
+  uint8_t prev_free = 0;
+  size_t free_blocks = 0;
+  size_t binned_blocks = 0;
+  int current_seen = 0;
+  int i;
 
-  p = first;
+  if (a->first == NULL) return 0;
 
+  p = a->first;
   do {
-    if ((uintptr_t) p < memory_start || (uintptr_t) p >= memory_end) {
-      printf("Block pointer 0x%08lx out of range\n", (uintptr_t) p);
-      return;
+    if (segment_of(a, (uintptr_t) p) == NULL)                   return 1;  // Block out of range
+    if (GET_PREV_FREE(p) != prev_free)                            return 2;  // Prev-free flag stale
+    if (p == a->current) current_seen = 1;
+
+    if (GET_FREE(p)) {
+      if (prev_free)                                              return 3;  // Two free blocks in a row
+      if (GET_NEXT(p) <= p)                                       return 4;  // Free dummy block
+      if (FOOTER(p) != p)                                         return 5;  // Boundary tag damaged
+      free_blocks++;
     }
+    prev_free = GET_FREE(p);
     p = GET_NEXT(p);
-  } while (p != first);
+  } while (p != a->first);
+
+  for (i = 0; i < NUM_BINS; i++) {
+    uint8_t mapped = (a->bin_map[i >> 6] >> (i & 63)) & 1;
+    BlockHeader * prev = NULL;
+
+    if (mapped != (a->bins[i] != NULL))                              return 6;  // Bin map out of sync
+    if (i >= FIRST_TREE_BIN) {
+      int ret = tree_check(a->bins[i], NULL, i, &binned_blocks);
+      if (ret) return ret;
+      continue;
+    }
+    for (p = a->bins[i]; p != NULL; p = FREE_NEXT(p)) {
+      if (!GET_FREE(p))                                           return 7;  // Allocated block in a bin
+      if (bin_index(SIZE(p)) != i)                                return 8;  // Block in the wrong bin
+      if (FREE_PREV(p) != prev)                                   return 9;  // Free list links damaged
+      prev = p;
+      binned_blocks++;
+    }
+  }
+
+  if (binned_blocks != free_blocks) return 10;  // Free block missing from the bins
+  if (!current_seen) return 12;                  // Next-fit pointer not on the list
+
+  for (i = 0; i < NUM_SMALL_BINS; i++) {
+    for (p = a->quick[i]; p != NULL; p = FREE_NEXT(p)) {
+      if (GET_FREE(p) || bin_index(SIZE(p)) != i)                return 13;  // Quick list damaged
+    }
+  }
+  return 0;
+}
+
+/**
+ * @name    simple_heap_check
+ * @brief   Walks the list of blocks and verifies the boundary tags and size classes
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_heap_check(void) {
+  int ret = 0;
+  int i;
+
+  for (i = 0; i < MAX_ARENAS && ret == 0; i++) {
+    Arena * a = &arenas[i];
+    if (i > 0 && !atomic_load(&a->ready)) continue;
+
+    pthread_mutex_lock(&a->lock);
+    remote_free_drain(a);
+    ret = heap_check(a);
+    pthread_mutex_unlock(&a->lock);
+  }
+  return ret;
+}
+
+/**
+ * @name    simple_heap_footprint
+ * @brief   Sums over the segments of the heap how far blocks in use reach into them
+ */
+size_t simple_heap_footprint(void) {
+  size_t footprint = 0;
+  int i;
+
+  for (i = 0; i < MAX_ARENAS; i++) {
+    Arena * a = &arenas[i];
+    Segment * segment;
+    if (!atomic_load(&a->ready)) continue;
+
+    pthread_mutex_lock(&a->lock);
+    // The first segment of another arena is a block of the main arena, counted there
+    for (segment = i == 0 ? &a->segment : a->segment.next; segment != NULL; segment = segment->next) {
+      BlockHeader * dummy = (BlockHeader *) (segment->end - sizeof(BlockHeader));
+      BlockHeader * p;
+      uintptr_t high = segment->start;
+
+      for (p = (BlockHeader *) segment->start; p != dummy; p = GET_NEXT(p)) {
+        if (!GET_FREE(p)) high = (uintptr_t) GET_NEXT(p);
+      }
+      footprint += high - segment->start;
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  return footprint;
 }
@@ -10,11 +10,16 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 
 /**
  * @name    simple_malloc
  * @brief   Allocate at least size contiguous bytes of memory and return a pointer to the first byte.
+ *          When the managed memory runs out, more is mapped from the OS.
  * @retval  Pointer to the start of the allocated memory or NULL if not possible.
  */
 void * simple_malloc(size_t size);
@@ -27,6 +32,394 @@ void * simple_malloc(size_t size);
 void simple_free(void * ptr);
 
 
+/**
+ * @name    simple_free_sized
+ * @brief   Frees memory like simple_free, given the size it was last allocated or
+ *          reallocated with. The size picks the way back to the allocator, so the
+ *          block header is not decoded. Built with MM_DEBUG, a size larger than the
+ *          block or a block already free aborts the program.
+ */
+void simple_free_sized(void * ptr, size_t size);
+
+
+/**
+ * @name    simple_malloc_batch
+ * @brief   Allocate n objects of at least size bytes each, stored in out. The objects are
+ *          carved out of as few free blocks as possible, one after the other, and are freed
+ *          one by one with simple_free or together with simple_free_batch.
+ * @retval  Number of objects allocated, less than n if the memory ran out.
+ */
+size_t simple_malloc_batch(size_t size, size_t n, void ** out);
+
+
+/**
+ * @name    simple_free_batch
+ * @brief   Frees n pointers at once. The pointers are sorted by address, which reorders ptrs,
+ *          and each run of adjacent blocks is merged with its neighbours once. NULL is skipped.
+ */
+void simple_free_batch(void ** ptrs, size_t n);
+
+
+/**
+ * @name    simple_calloc
+ * @brief   Allocate zeroed memory for an array of count elements of size bytes each.
+ *          Memory that was never handed out before is known to be zero and not cleared again.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_calloc(size_t count, size_t size);
+
+
+/**
+ * @name    simple_aligned_alloc
+ * @brief   Allocate at least size bytes starting at a multiple of alignment, which must be a
+ *          power of two. The memory is released with simple_free.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_aligned_alloc(size_t alignment, size_t size);
+
+
+/**
+ * @name    simple_realloc
+ * @brief   Changes the size of previously allocated memory, keeping its contents up to the
+ *          smaller of the old and new size. Grows into a free block that follows and shrinks
+ *          in place, so the memory only moves when there is no room behind it.
+ *          Behaves like simple_malloc for a NULL ptr and like simple_free for a size of 0.
+ * @retval  Pointer to the memory, NULL if not possible, in which case ptr is left as it was.
+ */
+void * simple_realloc(void * ptr, size_t size);
+
+
+/**
+ * @name    simple_usable_size
+ * @brief   Gets how many bytes of a block from simple_malloc and friends can be used,
+ *          at least as many as were asked for.
+ * @retval  Usable size of the block, 0 for NULL.
+ */
+size_t simple_usable_size(void * ptr);
+
+
+/**
+ * @name    simple_mallopt
+ * @brief   Adjusts a tunable of the allocator, see the MM_OPT_ parameters below.
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_mallopt(int param, long value);
+
+/**
+ * @name    MM_OPT_POLICY
+ * @brief   Placement policy simple_malloc uses to pick a free block. Can be
+ *          changed at any time; the default is set with -DMM_DEFAULT_POLICY.
+ */
+#define MM_OPT_POLICY        1
+
+#define MM_POLICY_FIRST_FIT  0   // Lowest addressed free block that fits, walks the block list
+#define MM_POLICY_NEXT_FIT   1   // First fit, resuming where the previous search stopped
+#define MM_POLICY_BEST_FIT   2   // Smallest free block that fits, from the size classes (default)
+#define MM_POLICY_TLSF       3   // Head of the first larger size class, bounded time
+
+/**
+ * @name    MM_OPT_THREAD_CACHE
+ * @brief   How many freed blocks of each small size a thread keeps for itself,
+ *          so that it can reuse them without taking the heap lock. 0 turns
+ *          the caches off. Flushes the cache of the calling thread.
+ */
+#define MM_OPT_THREAD_CACHE  2
+
+/**
+ * @name    MM_OPT_REMOTE_FREE
+ * @brief   When non-zero (default), simple_free does not wait for a thread that
+ *          holds the heap lock. It pushes the block on a lock-free queue, which
+ *          the next simple_malloc that takes the lock drains.
+ */
+#define MM_OPT_REMOTE_FREE   3
+
+/**
+ * @name    MM_OPT_ARENAS
+ * @brief   Number of arenas threads are spread over by the CPU they run on,
+ *          at most 16. Defaults to the number of CPUs. Each arena is a
+ *          separate heap with its own lock, carved out of the managed memory
+ *          when first used. Requests an arena cannot serve go to the others.
+ */
+#define MM_OPT_ARENAS        4
+
+/**
+ * @name    MM_OPT_THREAD_ARENA
+ * @brief   Attaches the calling thread to the given arena instead of the one
+ *          of its CPU, until the arena is contended.
+ */
+#define MM_OPT_THREAD_ARENA  5
+
+/**
+ * @name    MM_OPT_TRIM_THRESHOLD
+ * @brief   When a free block of at least this many bytes forms, the pages freed
+ *          into it are given back to the OS. Defaults to 1 MB, 0 leaves it to
+ *          simple_trim.
+ */
+#define MM_OPT_TRIM_THRESHOLD 6
+
+/**
+ * @name    MM_OPT_MMAP_THRESHOLD
+ * @brief   Requests of at least this many bytes get a mapping of their own from the OS,
+ *          which simple_free unmaps. Defaults to 1 MB, 0 keeps every request in the heap.
+ */
+#define MM_OPT_MMAP_THRESHOLD 7
+
+/**
+ * @name    MM_OPT_HUGE_PAGES
+ * @brief   Backs the heap by 2 MB pages, one of the MM_HUGE_PAGES_ modes below. Unless set
+ *          before the first allocation, the mode is read from the SIMPLE_MALLOC_HUGE_PAGES
+ *          environment variable ("thp" or "hugetlb"). Off by default.
+ */
+#define MM_OPT_HUGE_PAGES    8
+
+#define MM_HUGE_PAGES_OFF     0  // Regular pages
+#define MM_HUGE_PAGES_THP     1  // Transparent huge pages, asked for with madvise
+#define MM_HUGE_PAGES_HUGETLB 2  // Reserved huge pages for mapped memory, else transparent ones
+
+/**
+ * @name    MM_OPT_SMALL_PAGES
+ * @brief   When non-zero, requests of up to 64 bytes are served from 64 KB spans holding
+ *          objects of one size each, with no header per object. Off by default.
+ */
+#define MM_OPT_SMALL_PAGES   9
+
+/**
+ * @name    MM_OPT_DEFERRED_COALESCE
+ * @brief   When non-zero, freed blocks under 512 bytes wait on quick lists of their size
+ *          for reuse instead of being merged with their neighbours. They are merged when an
+ *          allocation finds no fitting block, or by simple_coalesce. Off by default.
+ */
+#define MM_OPT_DEFERRED_COALESCE 10
+
+
+/**
+ * @name    simple_trim
+ * @brief   Gives the pages inside all free blocks back to the OS right away, so the
+ *          resident memory of the process shrinks after a spike.
+ * @retval  Number of bytes given back.
+ */
+size_t simple_trim(void);
+
+
+/**
+ * @name    simple_coalesce
+ * @brief   Merges all blocks held back by MM_OPT_DEFERRED_COALESCE with their neighbours.
+ */
+void simple_coalesce(void);
+
+
+/**
+ * @name    SimplePool
+ * @brief   A pool of objects of one size, see simple_pool_create.
+ */
+typedef struct SimplePool SimplePool;
+
+
+/**
+ * @name    simple_pool_create
+ * @brief   Creates a pool handing out objects of obj_size bytes. The objects have no header
+ *          and are carved out of large slabs from simple_malloc, so allocating and freeing
+ *          them takes constant time. Objects up to 64 KB are supported.
+ * @retval  Pointer to the pool or NULL if not possible.
+ */
+SimplePool * simple_pool_create(size_t obj_size);
+
+
+/**
+ * @name    simple_pool_alloc
+ * @brief   Allocate one object from the pool.
+ * @retval  Pointer to the object or NULL if not possible.
+ */
+void * simple_pool_alloc(SimplePool * pool);
+
+
+/**
+ * @name    simple_pool_free
+ * @brief   Returns an object to the pool it was allocated from.
+ */
+void simple_pool_free(SimplePool * pool, void * obj);
+
+
+/**
+ * @name    simple_pool_destroy
+ * @brief   Frees the pool with all its slabs, including objects that were not returned.
+ */
+void simple_pool_destroy(SimplePool * pool);
+
+
+/**
+ * @name    SimpleRegion
+ * @brief   A region of objects released all at once, see simple_region_create.
+ */
+typedef struct SimpleRegion SimpleRegion;
+
+
+/**
+ * @name    simple_region_create
+ * @brief   Creates an empty region. Objects are bump allocated out of chunks from
+ *          simple_malloc and released together by simple_region_reset or simple_region_destroy.
+ *          A region must not be used by several threads at once.
+ * @retval  Pointer to the region or NULL if not possible.
+ */
+SimpleRegion * simple_region_create(void);
+
+
+/**
+ * @name    simple_region_alloc
+ * @brief   Allocate at least size contiguous bytes of memory from the region.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_region_alloc(SimpleRegion * region, size_t size);
+
+
+/**
+ * @name    simple_region_reset
+ * @brief   Releases every object of the region at once, keeping its largest chunk for reuse.
+ *          Chunks grown beyond the usual size for one large object are not kept.
+ */
+void simple_region_reset(SimpleRegion * region);
+
+
+/**
+ * @name    simple_region_destroy
+ * @brief   Releases every object of the region and the region itself.
+ */
+void simple_region_destroy(SimpleRegion * region);
+
+
+/**
+ * @name    SimpleHandle
+ * @brief   A handle to a block the allocator may move, see simple_halloc.
+ */
+typedef struct SimpleHandle SimpleHandle;
+
+
+/**
+ * @name    simple_halloc
+ * @brief   Allocate at least size bytes behind a handle. The block may be moved by
+ *          simple_compact while it is not locked, so its address is only valid
+ *          between simple_hlock and simple_hunlock.
+ * @retval  Handle to the block or NULL if not possible.
+ */
+SimpleHandle * simple_halloc(size_t size);
+
+
+/**
+ * @name    simple_hlock
+ * @brief   Pins the block of a handle where it is. Locks nest.
+ * @retval  Pointer to the start of the block.
+ */
+void * simple_hlock(SimpleHandle * handle);
+
+
+/**
+ * @name    simple_hunlock
+ * @brief   Undoes one simple_hlock, the block may move again once none is left.
+ */
+void simple_hunlock(SimpleHandle * handle);
+
+
+/**
+ * @name    simple_hfree
+ * @brief   Frees the block of a handle and the handle itself.
+ */
+void simple_hfree(SimpleHandle * handle);
+
+
+/**
+ * @name    simple_compact
+ * @brief   Slides the block of every unlocked handle down into the free memory right
+ *          below it, so free memory gathers above the blocks in larger runs. Each call
+ *          moves a block one step at most; repeat until it returns 0 to compact fully.
+ * @retval  Number of blocks moved.
+ */
+size_t simple_compact(void);
+
+
+/**
+ * @name    simple_slide
+ * @brief   Moves a block down into the free memory right below it, if there is any.
+ *          Nothing may point into the block while it moves, simple_compact uses it for
+ *          blocks behind unlocked handles.
+ * @retval  The new address of the block, or ptr if it stays where it is.
+ */
+void * simple_slide(void * ptr);
+
+
+/**
+ * @name    SimplePersist
+ * @brief   A heap kept in a file, see simple_persist_open.
+ */
+typedef struct SimplePersist SimplePersist;
+
+
+/**
+ * @name    simple_persist_open
+ * @brief   Maps the heap in the file at path, creating a heap of size bytes if the file is
+ *          empty or new. The file may be mapped at another address than before, so blocks
+ *          refer to each other by offsets and are found through named roots. The heap
+ *          does not grow, and must not be opened twice at once.
+ * @retval  Pointer to the heap or NULL if the file could not be mapped or holds no heap.
+ */
+SimplePersist * simple_persist_open(const char * path, size_t size);
+
+
+/**
+ * @name    simple_persist_alloc
+ * @brief   Allocate at least size contiguous bytes of memory in the file.
+ * @retval  Pointer to the start of the allocated memory or NULL if not possible.
+ */
+void * simple_persist_alloc(SimplePersist * heap, size_t size);
+
+
+/**
+ * @name    simple_persist_free
+ * @brief   Frees memory from simple_persist_alloc.
+ */
+void simple_persist_free(SimplePersist * heap, void * ptr);
+
+
+/**
+ * @name    simple_persist_set_root
+ * @brief   Names a block so that simple_persist_root finds it after the file is reopened.
+ *          Up to 16 names of at most 31 characters. A NULL ptr removes the name.
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_persist_set_root(SimplePersist * heap, const char * name, void * ptr);
+
+
+/**
+ * @name    simple_persist_root
+ * @brief   Finds a block by the name given to simple_persist_set_root.
+ * @retval  Pointer to the block or NULL if no block has the name.
+ */
+void * simple_persist_root(SimplePersist * heap, const char * name);
+
+
+/**
+ * @name    simple_persist_offset
+ * @brief   Turns a pointer into the heap into an offset, which stays valid across opens.
+ * @retval  Offset of the pointer, 0 for NULL.
+ */
+uint64_t simple_persist_offset(SimplePersist * heap, void * ptr);
+
+
+/**
+ * @name    simple_persist_pointer
+ * @brief   Turns an offset from simple_persist_offset back into a pointer.
+ * @retval  Pointer into the heap, NULL for offset 0.
+ */
+void * simple_persist_pointer(SimplePersist * heap, uint64_t offset);
+
+
+/**
+ * @name    simple_persist_close
+ * @brief   Writes the heap back to its file and unmaps it.
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_persist_close(SimplePersist * heap);
+
+
 /**
  * @name    The lowest address of the memory you will manage
  * @brief   This points to the lowest address of memory you will manage
@@ -36,7 +429,8 @@ extern const uintptr_t memory_start;
 
 /**
  * @name    The limit of the memory you will manage
- * @brief   This points to the first address of memory you will NOT manage
+ * @brief   This points to the first address of memory you will NOT manage. Memory mapped
+ *          later is managed as further segments with limits of their own.
  */
 extern const uintptr_t memory_end;
 
@@ -53,4 +447,22 @@ int simple_macro_test(void);
  */
 void simple_block_dump(void);
 
+/**
+ * @name    simple_heap_check
+ * @brief   Walks the list of blocks and verifies the boundary tags and size classes
+ * @retval  0 if ok, otherwise a positive number indicating the error cause
+ */
+int simple_heap_check(void);
+
+/**
+ * @name    simple_heap_footprint
+ * @brief   Gets the bytes of the heap spanned by blocks in use: for every segment, from its
+ *          start to the end of the highest block in use in it. Blocks mapped on their own
+ *          are not counted.
+ * @retval  Footprint of the heap in bytes.
+ */
+size_t simple_heap_footprint(void);
 
+#ifdef __cplusplus
+}
+#endif
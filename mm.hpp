@@ -0,0 +1,218 @@
+/**
+ * @file   mm.hpp
+ * @brief  C++ adapters for the memory management sub system: memory resources
+ *         for the std::pmr containers and an allocator for the others.
+ *
+ *             std::vector<int, SimpleAllocator<int>> v;
+ *
+ *             SimplePoolResource pool;
+ *             std::pmr::unordered_map<int, int> m(&pool);
+ *
+ * Requires C++17. Allocation failures throw std::bad_alloc, as the standard
+ * allocators do.
+ */
+
+#ifndef MM_HPP
+#define MM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory_resource>
+#include <new>
+#include "mm.h"
+
+// Allocates size bytes from simple_malloc, or simple_aligned_alloc for wider alignments
+inline void *simple_allocate(std::size_t size, std::size_t alignment) {
+    void *ptr = alignment <= alignof(void *) ? simple_malloc(size) : simple_aligned_alloc(alignment, size);
+    if (ptr == nullptr) throw std::bad_alloc();
+    return ptr;
+}
+
+// Gives back a block from simple_allocate, by its size where that is allowed
+inline void simple_deallocate(void *ptr, std::size_t size, std::size_t alignment) {
+    if (alignment <= alignof(void *)) {
+        simple_free_sized(ptr, size);
+    } else {
+        simple_free(ptr);
+    }
+}
+
+
+/**
+ * @name    SimpleResource
+ * @brief   A memory resource taking every block from simple_malloc and giving it back
+ *          with simple_free_sized. All instances share the one heap and compare equal.
+ *          Use simple_resource() rather than making instances.
+ */
+class SimpleResource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        return simple_allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        simple_deallocate(ptr, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const SimpleResource *>(&other) != nullptr;
+    }
+};
+
+
+/**
+ * @name    simple_resource
+ * @brief   Gets the shared SimpleResource, for instance to pass to
+ *          std::pmr::set_default_resource.
+ * @retval  Pointer to a resource that lives as long as the program.
+ */
+inline std::pmr::memory_resource *simple_resource() noexcept {
+    static SimpleResource resource;
+    return &resource;
+}
+
+
+/**
+ * @name    SimpleAllocator
+ * @brief   An allocator for the standard containers on simple_malloc. It has no state,
+ *          so containers using it can swap and move their memory freely.
+ */
+template <class T>
+struct SimpleAllocator {
+    using value_type = T;
+
+    SimpleAllocator() noexcept = default;
+
+    template <class U>
+    SimpleAllocator(const SimpleAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n) {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T)) throw std::bad_array_new_length();
+        return static_cast<T *>(simple_allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        simple_deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const SimpleAllocator<T> &, const SimpleAllocator<U> &) noexcept { return true; }
+
+template <class T, class U>
+bool operator!=(const SimpleAllocator<T> &, const SimpleAllocator<U> &) noexcept { return false; }
+
+
+/**
+ * @name    SimpleMonotonicResource
+ * @brief   A memory resource bump allocating out of a SimpleRegion. Deallocation does
+ *          nothing, release() frees everything at once and the destructor frees the
+ *          region. Like std::pmr::monotonic_buffer_resource it must not be used by
+ *          several threads at once.
+ */
+class SimpleMonotonicResource : public std::pmr::memory_resource {
+public:
+    SimpleMonotonicResource() : region(simple_region_create()) {
+        if (region == nullptr) throw std::bad_alloc();
+    }
+
+    SimpleMonotonicResource(const SimpleMonotonicResource &) = delete;
+    SimpleMonotonicResource &operator=(const SimpleMonotonicResource &) = delete;
+
+    ~SimpleMonotonicResource() override { simple_region_destroy(region); }
+
+    /* Releases every block of the resource, keeping the largest chunk for reuse */
+    void release() noexcept { simple_region_reset(region); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        // Region objects are aligned to a word, wider alignments take the slack
+        std::size_t slack = alignment > alignof(void *) ? alignment - alignof(void *) : 0;
+        if (bytes > std::numeric_limits<std::size_t>::max() - slack) throw std::bad_alloc();
+
+        void *ptr = simple_region_alloc(region, bytes + slack);
+        if (ptr == nullptr) throw std::bad_alloc();
+        return reinterpret_cast<void *>((reinterpret_cast<std::uintptr_t>(ptr) + alignment - 1) & ~(std::uintptr_t)(alignment - 1));
+    }
+
+    void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    SimpleRegion *region;
+};
+
+
+/**
+ * @name    SimplePoolResource
+ * @brief   A memory resource with a SimplePool for every size class up to
+ *          SimplePoolResource::max_pooled bytes. Larger or wider aligned blocks come
+ *          from simple_malloc. The pools take their own locks, so like
+ *          std::pmr::synchronized_pool_resource it can be shared by threads. The
+ *          destructor frees every pooled block, returned or not.
+ */
+class SimplePoolResource : public std::pmr::memory_resource {
+public:
+    static constexpr std::size_t max_pooled = 256;  // Largest pooled request in bytes
+
+    SimplePoolResource() {
+        for (std::size_t i = 0; i < num_pools; i++) {
+            pools[i] = simple_pool_create((i + 1) * granule);
+            if (pools[i] == nullptr) {
+                destroy_pools();
+                throw std::bad_alloc();
+            }
+        }
+    }
+
+    SimplePoolResource(const SimplePoolResource &) = delete;
+    SimplePoolResource &operator=(const SimplePoolResource &) = delete;
+
+    ~SimplePoolResource() override { destroy_pools(); }
+
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override {
+        if (!pooled(bytes, alignment)) return simple_allocate(bytes, alignment);
+
+        void *ptr = simple_pool_alloc(pools[pool_index(bytes)]);
+        if (ptr == nullptr) throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t alignment) override {
+        if (!pooled(bytes, alignment)) {
+            simple_deallocate(ptr, bytes, alignment);
+        } else {
+            simple_pool_free(pools[pool_index(bytes)], ptr);
+        }
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return this == &other;
+    }
+
+private:
+    static constexpr std::size_t granule = sizeof(void *);  // Pool objects are aligned to a word
+    static constexpr std::size_t num_pools = max_pooled / granule;
+
+    SimplePool *pools[num_pools] = {};
+
+    static bool pooled(std::size_t bytes, std::size_t alignment) noexcept {
+        return bytes <= max_pooled && alignment <= granule;
+    }
+
+    // Pool of the smallest size class holding bytes, 0 bytes share the first one
+    static std::size_t pool_index(std::size_t bytes) noexcept {
+        return bytes == 0 ? 0 : (bytes - 1) / granule;
+    }
+
+    void destroy_pools() noexcept {
+        for (std::size_t i = 0; i < num_pools; i++) simple_pool_destroy(pools[i]);
+    }
+};
+
+#endif
@@ -0,0 +1,705 @@
+/**
+ * @file   mm_bitmap.c
+ * @brief  Bitmap engine: the managed memory split into granules of one word,
+ *         with the allocation state kept out of line in bitmaps.
+ *
+ * A replacement for mm.c behind the same interface, linked instead of it
+ * (make malloc_check_bitmap runs the unit tests against it). Objects carry
+ * no header. One bitmap marks the granules in use and another the last
+ * granule of each object, so simple_free finds the end of an object with a
+ * scan of a few words. A summary bit per word of the used bitmap tells if the
+ * word is full, so the search for a free run passes 64 used words per summary
+ * word with __builtin_ctzll, and free words are passed four at a time with
+ * SSE2 where there is. All of it sits at the front of the managed memory,
+ * away from the objects.
+ *
+ * One lock guards the bitmaps. The memory does not grow: requests of at
+ * least the mmap threshold, and those that find no free run, get a mapping
+ * of their own. Next fit resumes the search where the last one ended, every
+ * other policy takes the lowest free run that fits.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "mm.h"
+
+#define GRANULE         (sizeof(void *))        // Bytes per bit of the bitmaps
+#define NO_RUN          ((size_t)-1)
+#define MAX_REQUEST     (SIZE_MAX / 4)          // Larger requests cannot be rounded without overflow
+#define MAX_ARENAS      (16)                    // Accepted by MM_OPT_ARENAS, there is one heap
+
+#define TRIM_DEFAULT    (1024 * 1024)
+#define MMAP_DEFAULT    (1024 * 1024)
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)
+#define HUGE_PAGES_ENV  "SIMPLE_MALLOC_HUGE_PAGES"
+#ifdef MADV_FREE
+#define TRIM_ADVICE     MADV_FREE
+#else
+#define TRIM_ADVICE     MADV_DONTNEED
+#endif
+
+#ifndef MM_DEFAULT_POLICY
+#define MM_DEFAULT_POLICY MM_POLICY_BEST_FIT
+#endif
+
+/* Bitmaps of the managed memory, one bit per granule */
+static struct {
+    pthread_mutex_t lock;
+    uintptr_t start;        // Address of granule 0
+    size_t granules;        // A multiple of 64
+    uint64_t *used;         // Granules handed out
+    uint64_t *last;         // Last granule of each object
+    uint64_t *full;         // Words of used with every bit set
+    size_t rover;           // Where next fit resumes
+    size_t top;             // Granules from here on were never handed out, so they are zero
+} heap = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+
+static atomic_int policy = MM_DEFAULT_POLICY;
+static atomic_int num_arenas = 1;
+static atomic_int huge_pages = -1;      // Not read from the environment yet
+static atomic_size_t trim_threshold = TRIM_DEFAULT;
+static atomic_size_t mmap_threshold = MMAP_DEFAULT;
+
+/* Header in front of an object with a mapping of its own */
+typedef struct {
+    void *base;
+    size_t length;
+} MapHeader;
+
+// Gets the huge page mode, reading it from the environment on first use
+static int huge_pages_mode(void) {
+    int mode = atomic_load_explicit(&huge_pages, memory_order_relaxed);
+
+    if (mode < 0) {
+        const char *env = getenv(HUGE_PAGES_ENV);
+        int expected = -1;
+
+        mode = MM_HUGE_PAGES_OFF;
+        if (env != NULL && strcmp(env, "thp") == 0) mode = MM_HUGE_PAGES_THP;
+        if (env != NULL && strcmp(env, "hugetlb") == 0) mode = MM_HUGE_PAGES_HUGETLB;
+        if (!atomic_compare_exchange_strong(&huge_pages, &expected, mode)) mode = expected;
+    }
+    return mode;
+}
+
+// Asks for transparent huge pages on the huge page aligned part of a range
+static void advise_huge_pages(uintptr_t start, uintptr_t end) {
+#ifdef MADV_HUGEPAGE
+    start = (start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    end &= ~(uintptr_t)(HUGE_PAGE_SIZE - 1);
+    if (end > start) madvise((void *)start, end - start, MADV_HUGEPAGE);
+#endif
+}
+
+// Places the bitmaps at the front of the managed memory and the granules after them
+static void heap_init(void) {
+    uintptr_t start = (memory_start + GRANULE - 1) & ~(uintptr_t)(GRANULE - 1);
+    size_t size = memory_end > start ? memory_end - start : 0;
+
+    // Per word of 64 granules: two bitmap words and a bit of the summary
+    size_t words = size / (64 * GRANULE + 2 * sizeof(uint64_t) + 1);
+    size_t summary = (words + 63) / 64;
+    size_t meta = (2 * words + summary) * sizeof(uint64_t);
+
+    heap.used = (uint64_t *)start;
+    heap.last = heap.used + words;
+    heap.full = heap.last + words;
+    heap.start = (start + meta + 63) & ~(uintptr_t)63;
+    while (words > 0 && heap.start + words * 64 * GRANULE > memory_end) words--;
+    heap.granules = words * 64;
+
+    if (huge_pages_mode() != MM_HUGE_PAGES_OFF) advise_huge_pages(start, memory_end);
+}
+
+// Checks if an object lives in the managed memory, not in a mapping of its own
+static int in_heap(void *ptr) {
+    return (uintptr_t)ptr >= heap.start && (uintptr_t)ptr < heap.start + heap.granules * GRANULE;
+}
+
+static size_t granule_of(void *ptr) {
+    return ((uintptr_t)ptr - heap.start) / GRANULE;
+}
+
+static void *granule_address(size_t g) {
+    return (void *)(heap.start + g * GRANULE);
+}
+
+// Granules an object of size bytes takes, at least one
+static size_t granules_for(size_t size) {
+    return size == 0 ? 1 : (size + GRANULE - 1) / GRANULE;
+}
+
+// Marks count granules from g as used or free, keeping the summary in step
+static void mark_used(size_t g, size_t count, int used) {
+    size_t end = g + count;
+
+    while (g < end) {
+        size_t w = g >> 6;
+        size_t bit = g & 63;
+        size_t n = end - g < 64 - bit ? end - g : 64 - bit;
+        uint64_t mask = (n == 64 ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1)) << bit;
+
+        if (used) heap.used[w] |= mask;
+        else heap.used[w] &= ~mask;
+
+        if (heap.used[w] == ~(uint64_t)0) heap.full[w >> 6] |= (uint64_t)1 << (w & 63);
+        else heap.full[w >> 6] &= ~((uint64_t)1 << (w & 63));
+        g += n;
+    }
+}
+
+static void mark_last(size_t g, int last) {
+    if (last) heap.last[g >> 6] |= (uint64_t)1 << (g & 63);
+    else heap.last[g >> 6] &= ~((uint64_t)1 << (g & 63));
+}
+
+// Passes free words from g, a multiple of 64, up to limit
+static size_t skip_free_words(size_t g, size_t limit) {
+#ifdef __SSE2__
+    while (g + 4 * 64 <= limit) {
+        const __m128i *p = (const __m128i *)&heap.used[g >> 6];
+        __m128i any = _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) break;
+        g += 4 * 64;
+    }
+#endif
+    while (g + 64 <= limit && heap.used[g >> 6] == 0) g += 64;
+    return g;
+}
+
+// Finds the first used granule in [g, limit), or returns limit
+static size_t next_used(size_t g, size_t limit) {
+    while (g < limit) {
+        size_t w = g >> 6;
+        uint64_t bits = heap.used[w] & (~(uint64_t)0 << (g & 63));
+
+        if (bits != 0) {
+            g = w * 64 + (size_t)__builtin_ctzll(bits);
+            return g < limit ? g : limit;
+        }
+        g = skip_free_words((w + 1) * 64, limit);
+    }
+    return limit;
+}
+
+// Finds the first free granule in [g, limit), or returns limit
+static size_t next_free(size_t g, size_t limit) {
+    size_t summary_words = (heap.granules / 64 + 63) / 64;
+
+    while (g < limit) {
+        size_t w = g >> 6;
+        uint64_t bits = ~heap.used[w] & (~(uint64_t)0 << (g & 63));
+
+        if (bits != 0) {
+            g = w * 64 + (size_t)__builtin_ctzll(bits);
+            return g < limit ? g : limit;
+        }
+
+        // Full words are passed through the summary
+        w++;
+        size_t s = w >> 6;
+        if (s >= summary_words) return limit;
+        uint64_t open = ~heap.full[s] & (~(uint64_t)0 << (w & 63));
+        while (open == 0) {
+            if (++s >= summary_words) return limit;
+            open = ~heap.full[s];
+        }
+        g = (s * 64 + (size_t)__builtin_ctzll(open)) * 64;
+    }
+    return limit;
+}
+
+// Finds the first run of count free granules in [g, limit) starting at a
+// multiple of alignment bytes, or returns NO_RUN
+static size_t find_run(size_t g, size_t limit, size_t count, size_t alignment) {
+    while (1) {
+        g = next_free(g, limit);
+        if (alignment > GRANULE) {
+            uintptr_t address = (heap.start + g * GRANULE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+            g = (address - heap.start) / GRANULE;
+        }
+        if (g >= limit || limit - g < count) return NO_RUN;
+
+        size_t end = next_used(g, g + count);
+        if (end == g + count) return g;
+        g = end;
+    }
+}
+
+// Hands out count granules. Caller holds the lock.
+static void *heap_alloc(size_t count, size_t alignment, size_t *dirty) {
+    size_t g = NO_RUN;
+
+    if (atomic_load_explicit(&policy, memory_order_relaxed) == MM_POLICY_NEXT_FIT) {
+        g = find_run(heap.rover, heap.granules, count, alignment);
+    }
+    if (g == NO_RUN) g = find_run(0, heap.granules, count, alignment);
+    if (g == NO_RUN) return NULL;
+
+    mark_used(g, count, 1);
+    mark_last(g + count - 1, 1);
+    heap.rover = g + count;
+
+    if (dirty != NULL) *dirty = g >= heap.top ? 0 : (heap.top - g < count ? heap.top - g : count) * GRANULE;
+    if (heap.top < g + count) heap.top = g + count;
+    return granule_address(g);
+}
+
+// Finds the last granule of the object starting at g
+static size_t object_end(size_t g) {
+    size_t w = g >> 6;
+    uint64_t bits = heap.last[w] & (~(uint64_t)0 << (g & 63));
+
+    while (bits == 0) bits = heap.last[++w];
+    return w * 64 + (size_t)__builtin_ctzll(bits);
+}
+
+// Gives back the whole pages between granules g and end. Returns the number of bytes released.
+static size_t range_trim(size_t g, size_t end, int advice) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+
+    if (huge_pages_mode() != MM_HUGE_PAGES_OFF) page = HUGE_PAGE_SIZE;  // Not to split them
+
+    uintptr_t start = ((uintptr_t)granule_address(g) + page - 1) & ~(page - 1);
+    uintptr_t stop = (uintptr_t)granule_address(end) & ~(page - 1);
+
+    if (stop <= start) return 0;
+    if (madvise((void *)start, stop - start, advice) != 0) {
+        if (advice == MADV_DONTNEED || madvise((void *)start, stop - start, MADV_DONTNEED) != 0) return 0;
+    }
+    return stop - start;
+}
+
+// Gives back the pages inside every free run, for simple_trim. Caller holds the lock.
+static size_t heap_trim(int advice) {
+    size_t released = 0;
+    size_t g = 0;
+
+    while ((g = next_free(g, heap.granules)) < heap.granules) {
+        size_t end = next_used(g, heap.granules);
+        released += range_trim(g, end, advice);
+        g = end;
+    }
+    return released;
+}
+
+// Finds where the free run that ends at granule g starts, looking back no further than lowest
+static size_t free_run_start(size_t g, size_t lowest) {
+    while (g > lowest) {
+        size_t w = (g - 1) >> 6;
+        uint64_t bits = heap.used[w] & (~(uint64_t)0 >> (63 - ((g - 1) & 63)));
+
+        if (bits != 0) {
+            size_t f = w * 64 + (size_t)(64 - __builtin_clzll(bits));
+            return f > lowest ? f : lowest;
+        }
+        g = w * 64;
+    }
+    return lowest;
+}
+
+// Frees count granules from g. If that leaves a free run of at least the trim
+// threshold, gives back the pages freed into it: those of the object, and of
+// neighbouring runs too short to have been trimmed when they were freed. The
+// run above heap.top counts as trimmed. Caller holds the lock.
+static void heap_release(size_t g, size_t count) {
+    size_t threshold = atomic_load_explicit(&trim_threshold, memory_order_relaxed);
+
+    mark_last(g + count - 1, 0);
+    mark_used(g, count, 0);
+    if (threshold == 0) return;
+
+    // Neighbours are only looked at as far as it takes to tell if they are long
+    size_t span = (threshold + GRANULE - 1) / GRANULE;
+    size_t limit = heap.top - (g + count) > span ? g + count + span : heap.top;
+    size_t f = free_run_start(g, g > span ? g - span : 0);
+    size_t end = next_used(g + count, limit);
+
+    if (end - f < span && end != heap.top) return;
+    range_trim(g - f >= span ? g : f, end == limit ? g + count : end, TRIM_ADVICE);
+}
+
+// Checks if a request should get a mapping of its own
+static int use_mmap(size_t size) {
+    size_t threshold = atomic_load_explicit(&mmap_threshold, memory_order_relaxed);
+    return threshold != 0 && size >= threshold;
+}
+
+// Serves a request with a mapping of its own, the header right below the object
+static void *map_object(size_t size, size_t alignment) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t offset = alignment > sizeof(MapHeader) ? alignment : sizeof(MapHeader);
+    size_t length = (offset + size + page - 1) & ~(page - 1);
+
+    uint8_t *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+    if (huge_pages_mode() != MM_HUGE_PAGES_OFF) advise_huge_pages((uintptr_t)base, (uintptr_t)base + length);
+
+    MapHeader *header = (MapHeader *)(base + offset) - 1;
+    header->base = base;
+    header->length = length;
+    return header + 1;
+}
+
+static void unmap_object(void *ptr) {
+    MapHeader *header = (MapHeader *)ptr - 1;
+    munmap(header->base, header->length);
+}
+
+// Allocates from the managed memory, else from a mapping of its own
+static void *bitmap_malloc(size_t size, size_t alignment, size_t *dirty) {
+    void *result;
+
+    pthread_once(&heap_once, heap_init);
+    if (!use_mmap(size)) {
+        pthread_mutex_lock(&heap.lock);
+        result = heap_alloc(granules_for(size), alignment, dirty);
+        pthread_mutex_unlock(&heap.lock);
+        if (result != NULL) return result;
+    }
+    if (dirty != NULL) *dirty = 0;  // Fresh pages are zero
+    return map_object(size, alignment);
+}
+
+void *simple_malloc(size_t size) {
+    if (size > MAX_REQUEST) return NULL;
+
+    return bitmap_malloc(size, GRANULE, NULL);
+}
+
+void *simple_calloc(size_t count, size_t size) {
+    size_t total;
+    size_t dirty;
+
+    if (__builtin_mul_overflow(count, size, &total) || total > MAX_REQUEST) return NULL;
+
+    void *result = bitmap_malloc(total, GRANULE, &dirty);
+    if (result != NULL) memset(result, 0, dirty < total ? dirty : total);
+    return result;
+}
+
+void *simple_aligned_alloc(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || size > MAX_REQUEST || alignment > MAX_REQUEST) {
+        return NULL;
+    }
+    return bitmap_malloc(size, alignment < GRANULE ? GRANULE : alignment, NULL);
+}
+
+void simple_free(void *ptr) {
+    if (ptr == NULL) return;
+
+    if (!in_heap(ptr)) {
+        unmap_object(ptr);
+        return;
+    }
+
+    size_t g = granule_of(ptr);
+    pthread_mutex_lock(&heap.lock);
+    heap_release(g, object_end(g) - g + 1);
+    pthread_mutex_unlock(&heap.lock);
+}
+
+void simple_free_sized(void *ptr, size_t size) {
+    if (ptr == NULL) return;
+
+    if (!in_heap(ptr)) {
+        unmap_object(ptr);
+        return;
+    }
+
+    // Objects take exactly the granules of their size, so no end mark is looked for
+    size_t g = granule_of(ptr);
+    size_t count = granules_for(size);
+
+    pthread_mutex_lock(&heap.lock);
+#ifdef MM_DEBUG
+    if (size > MAX_REQUEST || g + count > heap.granules || object_end(g) != g + count - 1 ||
+        next_free(g, g + count) != g + count) {
+        abort();  // Freed twice, or not the size it was allocated with
+    }
+#endif
+    heap_release(g, count);
+    pthread_mutex_unlock(&heap.lock);
+}
+
+void *simple_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return simple_malloc(size);
+    if (size == 0) {
+        simple_free(ptr);
+        return NULL;
+    }
+    if (size > MAX_REQUEST) return NULL;
+
+    size_t old_size;
+    void *result;
+
+    if (!in_heap(ptr)) {
+        MapHeader *header = (MapHeader *)ptr - 1;
+        size_t offset = (uint8_t *)ptr - (uint8_t *)header->base;
+
+        if (use_mmap(size)) {
+            size_t page = (size_t)sysconf(_SC_PAGESIZE);
+            size_t length = (offset + size + page - 1) & ~(page - 1);
+            uint8_t *base = mremap(header->base, header->length, length, MREMAP_MAYMOVE);
+            if (base == MAP_FAILED) return NULL;
+
+            header = (MapHeader *)(base + offset) - 1;
+            header->base = base;
+            header->length = length;
+            return header + 1;
+        }
+        old_size = header->length - offset;
+    } else {
+        size_t g = granule_of(ptr);
+        size_t count = granules_for(size);
+
+        int in_place = 1;
+
+        pthread_mutex_lock(&heap.lock);
+        size_t old_count = object_end(g) - g + 1;
+
+        // Shrinks in place, and grows in place into free granules right above
+        if (count < old_count) {
+            mark_last(g + old_count - 1, 0);
+            mark_last(g + count - 1, 1);
+            heap_release(g + count, old_count - count);
+        } else if (count > old_count && g + count <= heap.granules &&
+                   next_used(g + old_count, g + count) == g + count) {
+            mark_last(g + old_count - 1, 0);
+            mark_used(g + old_count, count - old_count, 1);
+            mark_last(g + count - 1, 1);
+            if (heap.top < g + count) heap.top = g + count;
+        } else if (count > old_count) {
+            in_place = 0;
+        }
+        pthread_mutex_unlock(&heap.lock);
+
+        if (in_place) return ptr;
+        old_size = old_count * GRANULE;
+    }
+
+    result = simple_malloc(size);
+    if (result == NULL) return NULL;
+    memcpy(result, ptr, old_size < size ? old_size : size);
+    simple_free(ptr);
+    return result;
+}
+
+size_t simple_malloc_batch(size_t size, size_t n, void **out) {
+    if (size > MAX_REQUEST) return 0;
+
+    size_t count = granules_for(size);
+    size_t run = n;
+    size_t done = 0;
+
+    pthread_once(&heap_once, heap_init);
+    if (!use_mmap(size)) {
+        pthread_mutex_lock(&heap.lock);
+        while (done < n && run > 0) {
+            if (run > n - done) run = n - done;
+            if (run > heap.granules / count) run = heap.granules / count;
+            if (run == 0) break;
+
+            // One run for all the objects, with an end mark for each
+            void *start = heap_alloc(run * count, GRANULE, NULL);
+            if (start == NULL) {
+                run /= 2;
+                continue;
+            }
+            size_t g = granule_of(start);
+            size_t i;
+            for (i = 0; i < run; i++) {
+                mark_last(g + i * count + count - 1, 1);
+                out[done++] = granule_address(g + i * count);
+            }
+        }
+        pthread_mutex_unlock(&heap.lock);
+    }
+
+    // The rest get mappings of their own
+    while (done < n && (out[done] = simple_malloc(size)) != NULL) done++;
+    return done;
+}
+
+void simple_free_batch(void **ptrs, size_t n) {
+    size_t mapped = 0;
+    size_t i;
+
+    pthread_mutex_lock(&heap.lock);
+    for (i = 0; i < n; i++) {
+        if (ptrs[i] == NULL) continue;
+        if (!in_heap(ptrs[i])) {
+            // Moved to the front, to be unmapped without holding the lock
+            void *ptr = ptrs[i];
+            ptrs[i] = ptrs[mapped];
+            ptrs[mapped++] = ptr;
+            continue;
+        }
+        size_t g = granule_of(ptrs[i]);
+        heap_release(g, object_end(g) - g + 1);
+    }
+    pthread_mutex_unlock(&heap.lock);
+
+    for (i = 0; i < mapped; i++) unmap_object(ptrs[i]);
+}
+
+size_t simple_usable_size(void *ptr) {
+    size_t size;
+
+    if (ptr == NULL) return 0;
+    if (!in_heap(ptr)) {
+        MapHeader *header = (MapHeader *)ptr - 1;
+        return header->length - (size_t)((uint8_t *)ptr - (uint8_t *)header->base);
+    }
+
+    size_t g = granule_of(ptr);
+    pthread_mutex_lock(&heap.lock);
+    size = (object_end(g) - g + 1) * GRANULE;
+    pthread_mutex_unlock(&heap.lock);
+    return size;
+}
+
+void *simple_slide(void *ptr) {
+    if (ptr == NULL || !in_heap(ptr)) return ptr;
+
+    size_t g = granule_of(ptr);
+
+    pthread_mutex_lock(&heap.lock);
+    size_t f = free_run_start(g, 0);
+    if (f < g) {
+        size_t count = object_end(g) - g + 1;
+
+        memmove(granule_address(f), ptr, count * GRANULE);
+        mark_last(g + count - 1, 0);
+        mark_used(g, count, 0);
+        mark_used(f, count, 1);
+        mark_last(f + count - 1, 1);
+        ptr = granule_address(f);
+    }
+    pthread_mutex_unlock(&heap.lock);
+    return ptr;
+}
+
+size_t simple_trim(void) {
+    size_t released;
+
+    pthread_once(&heap_once, heap_init);
+    pthread_mutex_lock(&heap.lock);
+    released = heap_trim(MADV_DONTNEED);
+    pthread_mutex_unlock(&heap.lock);
+    return released;
+}
+
+void simple_coalesce(void) {
+    // Free granules are merged as soon as their bits are cleared
+}
+
+int simple_mallopt(int param, long value) {
+    int ret = 0;
+
+    switch (param) {
+    case MM_OPT_POLICY:
+        if (value < MM_POLICY_FIRST_FIT || value > MM_POLICY_TLSF) return 2;
+        atomic_store(&policy, (int)value);
+        break;
+    case MM_OPT_THREAD_CACHE:
+        if (value < 0 || value > UINT16_MAX) return 2;
+        break;
+    case MM_OPT_ARENAS:
+        if (value < 1 || value > MAX_ARENAS) return 2;
+        atomic_store(&num_arenas, (int)value);
+        break;
+    case MM_OPT_THREAD_ARENA:
+        if (value < 0 || value >= atomic_load(&num_arenas)) return 2;
+        break;
+    case MM_OPT_TRIM_THRESHOLD:
+        if (value < 0) return 2;
+        atomic_store(&trim_threshold, (size_t)value);
+        break;
+    case MM_OPT_MMAP_THRESHOLD:
+        if (value < 0) return 2;
+        atomic_store(&mmap_threshold, (size_t)value);
+        break;
+    case MM_OPT_HUGE_PAGES:
+        if (value < MM_HUGE_PAGES_OFF || value > MM_HUGE_PAGES_HUGETLB) return 2;
+        atomic_store(&huge_pages, (int)value);
+        if (value != MM_HUGE_PAGES_OFF) advise_huge_pages(memory_start, memory_end);
+        break;
+    case MM_OPT_REMOTE_FREE:
+    case MM_OPT_SMALL_PAGES:
+    case MM_OPT_DEFERRED_COALESCE:
+        break;  // Nothing to do without headers and with one lock
+    default:
+        ret = 1;
+    }
+    return ret;
+}
+
+int simple_macro_test(void) {
+    return 0;  // No header macros in this engine
+}
+
+void simple_block_dump(void) {
+    size_t g = 0;
+
+    pthread_once(&heap_once, heap_init);
+    pthread_mutex_lock(&heap.lock);
+    printf("granules at 0x%08lx, %zu of %zu bytes\n", (unsigned long)heap.start, heap.granules, GRANULE);
+    while (g < heap.granules) {
+        size_t end;
+        if (heap.used[g >> 6] & ((uint64_t)1 << (g & 63))) {
+            end = object_end(g) + 1;
+            printf("used 0x%08lx %zu bytes\n", (unsigned long)granule_address(g), (end - g) * GRANULE);
+        } else {
+            end = next_used(g, heap.granules);
+            printf("free 0x%08lx %zu bytes\n", (unsigned long)granule_address(g), (end - g) * GRANULE);
+        }
+        g = end;
+    }
+    pthread_mutex_unlock(&heap.lock);
+}
+
+int simple_heap_check(void) {
+    size_t words, w;
+    int ret = 0;
+
+    pthread_once(&heap_once, heap_init);
+    pthread_mutex_lock(&heap.lock);
+    words = heap.granules / 64;
+    for (w = 0; w < words && ret == 0; w++) {
+        uint64_t used = heap.used[w];
+        uint64_t next = w + 1 < words ? heap.used[w + 1] & 1 : 0;
+        uint64_t ends = used & ~((used >> 1) | (next << 63));  // Used granules followed by free ones
+        int full = (heap.full[w >> 6] >> (w & 63)) & 1;
+
+        if (full != (used == ~(uint64_t)0)) ret = 1;                 // Summary does not match
+        else if ((heap.last[w] & ~used) != 0) ret = 2;              // End mark on a free granule
+        else if ((ends & ~heap.last[w]) != 0) ret = 3;              // Object without an end mark
+    }
+    pthread_mutex_unlock(&heap.lock);
+    return ret;
+}
+
+size_t simple_heap_footprint(void) {
+    size_t w;
+
+    pthread_once(&heap_once, heap_init);
+    pthread_mutex_lock(&heap.lock);
+    for (w = heap.granules / 64; w > 0 && heap.used[w - 1] == 0; w--) {}
+    size_t top = w == 0 ? 0 : (w - 1) * 64 + 64 - (size_t)__builtin_clzll(heap.used[w - 1]);
+    pthread_mutex_unlock(&heap.lock);
+    return top * GRANULE;
+}
@@ -0,0 +1,122 @@
+/**
+ * @file   mm_handle.c
+ * @brief  Handles to blocks the allocator may move, and compaction.
+ *
+ * A handle is a slot in a table holding the current address of its block and
+ * how often it is locked. simple_compact slides the blocks of unlocked handles
+ * down with simple_slide, so that the free memory between them gathers into
+ * larger runs. Blocks not behind a handle stay where they are.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mm.h"
+
+#define HANDLE_CHUNK (256)  // Slots per chunk of the handle table
+
+struct SimpleHandle {
+    void *ptr;                  // NULL while the slot is free
+    unsigned int locks;
+    SimpleHandle *next_free;
+};
+
+/* Chunks of the handle table, so simple_compact can walk every slot */
+typedef struct HandleChunk {
+    struct HandleChunk *next;
+    SimpleHandle slots[HANDLE_CHUNK];
+} HandleChunk;
+
+/* Guards the table, and keeps blocks from moving while they are locked */
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+static HandleChunk *chunks = NULL;
+static SimpleHandle *free_slots = NULL;
+
+// Adds a chunk of free slots to the table. Caller holds the handle lock.
+static int handles_grow(void) {
+    HandleChunk *chunk = simple_malloc(sizeof(HandleChunk));
+    int i;
+
+    if (chunk == NULL) return 0;
+    for (i = 0; i < HANDLE_CHUNK; i++) {
+        chunk->slots[i].ptr = NULL;
+        chunk->slots[i].locks = 0;
+        chunk->slots[i].next_free = i + 1 < HANDLE_CHUNK ? &chunk->slots[i + 1] : free_slots;
+    }
+    free_slots = &chunk->slots[0];
+    chunk->next = chunks;
+    chunks = chunk;
+    return 1;
+}
+
+SimpleHandle *simple_halloc(size_t size) {
+    SimpleHandle *handle = NULL;
+    void *ptr = simple_malloc(size);
+
+    if (ptr == NULL) return NULL;
+
+    pthread_mutex_lock(&handle_lock);
+    if (free_slots != NULL || handles_grow()) {
+        handle = free_slots;
+        free_slots = handle->next_free;
+        handle->ptr = ptr;
+        handle->locks = 0;
+    }
+    pthread_mutex_unlock(&handle_lock);
+
+    if (handle == NULL) simple_free(ptr);
+    return handle;
+}
+
+void *simple_hlock(SimpleHandle *handle) {
+    void *ptr;
+
+    pthread_mutex_lock(&handle_lock);
+    handle->locks++;
+    ptr = handle->ptr;
+    pthread_mutex_unlock(&handle_lock);
+    return ptr;
+}
+
+void simple_hunlock(SimpleHandle *handle) {
+    pthread_mutex_lock(&handle_lock);
+    if (handle->locks > 0) handle->locks--;
+    pthread_mutex_unlock(&handle_lock);
+}
+
+void simple_hfree(SimpleHandle *handle) {
+    void *ptr;
+
+    if (handle == NULL) return;
+
+    pthread_mutex_lock(&handle_lock);
+    ptr = handle->ptr;
+    handle->ptr = NULL;
+    handle->next_free = free_slots;
+    free_slots = handle;
+    pthread_mutex_unlock(&handle_lock);
+    simple_free(ptr);
+}
+
+size_t simple_compact(void) {
+    size_t moved = 0;
+    HandleChunk *chunk;
+    int i;
+
+    simple_coalesce();  // Blocks held back on quick lists would stay in the way
+
+    pthread_mutex_lock(&handle_lock);
+    for (chunk = chunks; chunk != NULL; chunk = chunk->next) {
+        for (i = 0; i < HANDLE_CHUNK; i++) {
+            SimpleHandle *handle = &chunk->slots[i];
+            if (handle->ptr == NULL || handle->locks != 0) continue;
+
+            void *ptr = simple_slide(handle->ptr);
+            if (ptr != handle->ptr) {
+                handle->ptr = ptr;
+                moved++;
+            }
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+    return moved;
+}
@@ -0,0 +1,318 @@
+/**
+ * @file   mm_persist.c
+ * @brief  Persistent heaps: blocks in a file mapped into memory, found again
+ *         through named roots after the file is reopened.
+ *
+ * Nothing in the file holds an address. A block header holds the size of
+ * its payload, with bit 0 set if the block is free and bit 1 if the block
+ * below it is free, and free blocks end in a boundary tag with the offset
+ * of their header. The free lists are rebuilt from the blocks on every open,
+ * so the file may be mapped anywhere. Data that refers to other blocks
+ * stores offsets from simple_persist_offset. The file does not grow.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mm.h"
+
+#define PERSIST_MAGIC     (0x3150414548504d53ULL)  // "SMPHEAP1"
+#define PERSIST_ROOTS     (16)
+#define PERSIST_NAME      (32)                     // Bytes in a root name, with the terminator
+#define PERSIST_BINS      (64)                     // Free lists by power of two size
+#define PERSIST_MIN_SIZE  (3 * sizeof(uint64_t))   // Free list links plus boundary tag
+
+#define PERSIST_FREE      (1)
+#define PERSIST_PREV_FREE (2)
+#define PERSIST_FLAGS     (7)
+
+typedef struct {
+    char name[PERSIST_NAME];
+    uint64_t offset;        // 0 if the slot is unused
+} PersistRoot;
+
+/* Start of the file. Blocks follow, up to an end block of size 0. */
+typedef struct {
+    uint64_t magic;
+    uint64_t size;          // Bytes in the file
+    PersistRoot roots[PERSIST_ROOTS];
+} PersistHeader;
+
+#define FIRST_BLOCK ((sizeof(PersistHeader) + 7) & ~(uint64_t)7)
+
+struct SimplePersist {
+    pthread_mutex_t lock;
+    uint8_t *base;
+    uint64_t size;
+    int fd;
+    uint64_t bins[PERSIST_BINS];   // Offsets of the first free block of each size, 0 if none
+};
+
+// Gets the word at an offset in the file
+static uint64_t *word_at(SimplePersist *heap, uint64_t offset) {
+    return (uint64_t *)(heap->base + offset);
+}
+
+static uint64_t block_size(SimplePersist *heap, uint64_t block) {
+    return *word_at(heap, block) & ~(uint64_t)PERSIST_FLAGS;
+}
+
+static uint64_t next_block(SimplePersist *heap, uint64_t block) {
+    return block + sizeof(uint64_t) + block_size(heap, block);
+}
+
+static int bin_of(uint64_t size) {
+    return 63 - __builtin_clzll(size);
+}
+
+/* Free list links, offsets kept in the first two words of a free payload */
+#define NEXT_FREE(heap, block) (*word_at(heap, (block) + 8))
+#define PREV_FREE(heap, block) (*word_at(heap, (block) + 16))
+
+static void bin_insert(SimplePersist *heap, uint64_t block) {
+    int i = bin_of(block_size(heap, block));
+
+    NEXT_FREE(heap, block) = heap->bins[i];
+    PREV_FREE(heap, block) = 0;
+    if (heap->bins[i] != 0) PREV_FREE(heap, heap->bins[i]) = block;
+    heap->bins[i] = block;
+}
+
+static void bin_remove(SimplePersist *heap, uint64_t block) {
+    int i = bin_of(block_size(heap, block));
+    uint64_t next = NEXT_FREE(heap, block);
+    uint64_t prev = PREV_FREE(heap, block);
+
+    if (prev != 0) NEXT_FREE(heap, prev) = next;
+    else heap->bins[i] = next;
+    if (next != 0) PREV_FREE(heap, next) = prev;
+}
+
+// Sets the size of a block, keeping its flags
+static void set_block_size(SimplePersist *heap, uint64_t block, uint64_t size) {
+    *word_at(heap, block) = (*word_at(heap, block) & PERSIST_FLAGS) | size;
+}
+
+// Marks a block free or used, keeping its boundary tag and the prev-free
+// flag of the block above up to date
+static void mark_free(SimplePersist *heap, uint64_t block, int free) {
+    uint64_t next = next_block(heap, block);
+
+    if (free) {
+        *word_at(heap, block) |= PERSIST_FREE;
+        *word_at(heap, next - sizeof(uint64_t)) = block;
+        *word_at(heap, next) |= PERSIST_PREV_FREE;
+    } else {
+        *word_at(heap, block) &= ~(uint64_t)PERSIST_FREE;
+        *word_at(heap, next) &= ~(uint64_t)PERSIST_PREV_FREE;
+    }
+}
+
+// Lays out a new file: the header, one free block and the end block
+static void persist_format(SimplePersist *heap) {
+    PersistHeader *header = (PersistHeader *)heap->base;
+    uint64_t end = heap->size - sizeof(uint64_t);
+
+    memset(header, 0, sizeof(PersistHeader));
+    header->magic = PERSIST_MAGIC;
+    header->size = heap->size;
+    *word_at(heap, FIRST_BLOCK) = end - FIRST_BLOCK - sizeof(uint64_t);
+    *word_at(heap, end) = 0;
+    mark_free(heap, FIRST_BLOCK, 1);
+    bin_insert(heap, FIRST_BLOCK);
+}
+
+// Rebuilds the free lists of a file, merging free blocks next to each other.
+// Returns 0 if the blocks do not add up to the file.
+static int persist_rebuild(SimplePersist *heap) {
+    uint64_t end = heap->size - sizeof(uint64_t);
+    uint64_t block = FIRST_BLOCK;
+    uint64_t free_block = 0;    // Free block right below the current one
+
+    while (block < end) {
+        uint64_t size = block_size(heap, block);
+        if (size < PERSIST_MIN_SIZE || size > end - block - sizeof(uint64_t)) return 0;
+
+        if (free_block == 0) *word_at(heap, block) &= ~(uint64_t)PERSIST_PREV_FREE;
+        if (*word_at(heap, block) & PERSIST_FREE) {
+            if (free_block != 0) {
+                set_block_size(heap, free_block, block_size(heap, free_block) + sizeof(uint64_t) + size);
+                block = free_block;
+            }
+            mark_free(heap, block, 1);
+            free_block = block;
+        } else {
+            if (free_block != 0) bin_insert(heap, free_block);
+            free_block = 0;
+        }
+        block = next_block(heap, block);
+    }
+    if (block != end || block_size(heap, end) != 0) return 0;
+
+    if (free_block != 0) bin_insert(heap, free_block);
+    else *word_at(heap, end) &= ~(uint64_t)PERSIST_PREV_FREE;
+    return 1;
+}
+
+SimplePersist *simple_persist_open(const char *path, size_t size) {
+    struct stat st;
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) return NULL;
+
+    SimplePersist *heap = simple_malloc(sizeof(SimplePersist));
+    if (heap == NULL || fstat(fd, &st) != 0) goto fail;
+
+    int fresh = st.st_size == 0;
+    heap->size = fresh ? (size & ~(size_t)7) : (uint64_t)st.st_size;
+    if (heap->size < FIRST_BLOCK + 2 * sizeof(uint64_t) + PERSIST_MIN_SIZE) goto fail;
+    if (fresh && ftruncate(fd, (off_t)heap->size) != 0) goto fail;
+
+    heap->base = mmap(NULL, heap->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (heap->base == MAP_FAILED) goto fail;
+
+    heap->fd = fd;
+    memset(heap->bins, 0, sizeof(heap->bins));
+    pthread_mutex_init(&heap->lock, NULL);
+
+    if (fresh) {
+        persist_format(heap);
+    } else {
+        PersistHeader *header = (PersistHeader *)heap->base;
+        if (header->magic != PERSIST_MAGIC || header->size != heap->size || !persist_rebuild(heap)) {
+            munmap(heap->base, heap->size);
+            pthread_mutex_destroy(&heap->lock);
+            goto fail;
+        }
+    }
+    return heap;
+
+fail:
+    simple_free(heap);
+    close(fd);
+    return NULL;
+}
+
+void *simple_persist_alloc(SimplePersist *heap, size_t size) {
+    if (size > heap->size) return NULL;  // Also guards the rounding below
+
+    uint64_t aligned_size = (size + 7) & ~(uint64_t)7;
+    uint64_t block = 0;
+    int i;
+
+    if (aligned_size < PERSIST_MIN_SIZE) aligned_size = PERSIST_MIN_SIZE;
+
+    pthread_mutex_lock(&heap->lock);
+    // First fit in the class of the size, any block of a larger class fits
+    for (block = heap->bins[bin_of(aligned_size)]; block != 0; block = NEXT_FREE(heap, block)) {
+        if (block_size(heap, block) >= aligned_size) break;
+    }
+    for (i = bin_of(aligned_size) + 1; block == 0 && i < PERSIST_BINS; i++) {
+        block = heap->bins[i];
+    }
+    if (block == 0) {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+
+    uint64_t block_total = block_size(heap, block);
+    bin_remove(heap, block);
+    if (block_total - aligned_size >= sizeof(uint64_t) + PERSIST_MIN_SIZE) {
+        // Split, the remainder goes back on its free list
+        uint64_t rest = block + sizeof(uint64_t) + aligned_size;
+        set_block_size(heap, block, aligned_size);
+        *word_at(heap, rest) = block_total - aligned_size - sizeof(uint64_t);
+        mark_free(heap, rest, 1);
+        bin_insert(heap, rest);
+    }
+    mark_free(heap, block, 0);
+    pthread_mutex_unlock(&heap->lock);
+    return heap->base + block + sizeof(uint64_t);
+}
+
+void simple_persist_free(SimplePersist *heap, void *ptr) {
+    if (ptr == NULL) return;
+
+    uint64_t block = (uint64_t)((uint8_t *)ptr - heap->base) - sizeof(uint64_t);
+
+    pthread_mutex_lock(&heap->lock);
+    uint64_t next = next_block(heap, block);
+    if (*word_at(heap, next) & PERSIST_FREE) {
+        bin_remove(heap, next);
+        set_block_size(heap, block, block_size(heap, block) + sizeof(uint64_t) + block_size(heap, next));
+    }
+    if (*word_at(heap, block) & PERSIST_PREV_FREE) {
+        uint64_t prev = *word_at(heap, block - sizeof(uint64_t));
+        bin_remove(heap, prev);
+        set_block_size(heap, prev, block_size(heap, prev) + sizeof(uint64_t) + block_size(heap, block));
+        block = prev;
+    }
+    mark_free(heap, block, 1);
+    bin_insert(heap, block);
+    pthread_mutex_unlock(&heap->lock);
+}
+
+int simple_persist_set_root(SimplePersist *heap, const char *name, void *ptr) {
+    PersistHeader *header = (PersistHeader *)heap->base;
+    PersistRoot *slot = NULL;
+    int i;
+
+    if (strlen(name) >= PERSIST_NAME) return 2;
+
+    pthread_mutex_lock(&heap->lock);
+    for (i = 0; i < PERSIST_ROOTS; i++) {
+        PersistRoot *root = &header->roots[i];
+        if (root->offset != 0 && strcmp(root->name, name) == 0) {
+            slot = root;
+            break;
+        }
+        if (root->offset == 0 && slot == NULL) slot = root;
+    }
+    if (slot != NULL) {
+        strncpy(slot->name, name, PERSIST_NAME);
+        slot->offset = simple_persist_offset(heap, ptr);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return slot == NULL ? 3 : 0;
+}
+
+void *simple_persist_root(SimplePersist *heap, const char *name) {
+    PersistHeader *header = (PersistHeader *)heap->base;
+    void *ptr = NULL;
+    int i;
+
+    pthread_mutex_lock(&heap->lock);
+    for (i = 0; i < PERSIST_ROOTS; i++) {
+        if (header->roots[i].offset != 0 && strncmp(header->roots[i].name, name, PERSIST_NAME) == 0) {
+            ptr = heap->base + header->roots[i].offset;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+uint64_t simple_persist_offset(SimplePersist *heap, void *ptr) {
+    return ptr == NULL ? 0 : (uint64_t)((uint8_t *)ptr - heap->base);
+}
+
+void *simple_persist_pointer(SimplePersist *heap, uint64_t offset) {
+    return offset == 0 ? NULL : heap->base + offset;
+}
+
+int simple_persist_close(SimplePersist *heap) {
+    int ret = 0;
+
+    if (heap == NULL) return 0;
+    if (msync(heap->base, heap->size, MS_SYNC) != 0) ret = 1;
+    munmap(heap->base, heap->size);
+    if (close(heap->fd) != 0) ret = 1;
+    pthread_mutex_destroy(&heap->lock);
+    simple_free(heap);
+    return ret;
+}
@@ -0,0 +1,99 @@
+/**
+ * @file   mm_pool.c
+ * @brief  Pools of fixed size objects carved out of slabs from simple_malloc.
+ *
+ * Objects carry no header. A slab is handed out front to back through a bump
+ * pointer, and freed objects go on a free list linked through their first
+ * word, so both simple_pool_alloc and simple_pool_free take constant time.
+ */
+
+#include <stdint.h>
+#include <pthread.h>
+#include "mm.h"
+
+#define POOL_SLAB_SIZE    (64 * 1024)  // Bytes per slab, unless objects are larger
+#define POOL_SLAB_OBJECTS (8)          // Objects per slab at least
+
+/* Slabs of a pool are kept on a list, so simple_pool_destroy can free them */
+typedef struct Slab {
+    struct Slab *next;
+} Slab;
+
+struct SimplePool {
+    pthread_mutex_t lock;
+    size_t obj_size;        // Rounded up to hold the free list link
+    size_t slab_size;
+    Slab *slabs;
+    void *free_list;        // Freed objects, linked through their first word
+    uint8_t *bump;          // Next object never handed out in the newest slab
+    uint8_t *bump_end;
+};
+
+SimplePool *simple_pool_create(size_t obj_size) {
+    if (obj_size == 0 || obj_size > POOL_SLAB_SIZE) return NULL;
+
+    SimplePool *pool = simple_malloc(sizeof(SimplePool));
+    if (pool == NULL) return NULL;
+
+    pool->obj_size = (obj_size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
+    pool->slab_size = POOL_SLAB_SIZE;
+    if (pool->slab_size < sizeof(Slab) + POOL_SLAB_OBJECTS * pool->obj_size) {
+        pool->slab_size = sizeof(Slab) + POOL_SLAB_OBJECTS * pool->obj_size;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->bump = NULL;
+    pool->bump_end = NULL;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+// Adds a slab to the pool. Caller holds the pool lock.
+static int pool_grow(SimplePool *pool) {
+    Slab *slab = simple_malloc(pool->slab_size);
+    if (slab == NULL) return 0;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->bump = (uint8_t *)(slab + 1);
+    pool->bump_end = (uint8_t *)slab + pool->slab_size;
+    return 1;
+}
+
+void *simple_pool_alloc(SimplePool *pool) {
+    void *obj;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list != NULL) {
+        obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+    } else if (pool->bump + pool->obj_size <= pool->bump_end || pool_grow(pool)) {
+        obj = pool->bump;
+        pool->bump += pool->obj_size;
+    } else {
+        obj = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+}
+
+void simple_pool_free(SimplePool *pool, void *obj) {
+    if (obj == NULL) return;
+
+    pthread_mutex_lock(&pool->lock);
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void simple_pool_destroy(SimplePool *pool) {
+    if (pool == NULL) return;
+
+    while (pool->slabs != NULL) {
+        Slab *slab = pool->slabs;
+        pool->slabs = slab->next;
+        simple_free(slab);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    simple_free(pool);
+}
@@ -0,0 +1,205 @@
+/**
+ * @file   mm_preload.c
+ * @brief  Stands in for the allocator of the C library, so that any program
+ *         can run on simple_malloc:
+ *
+ *             make libmm.so
+ *             LD_PRELOAD=$PWD/libmm.so program
+ *
+ * Blocks are 16 byte aligned like those of the C library, which takes the
+ * simple_aligned_alloc path for all but the smallest requests. Freed blocks
+ * stay aligned in the thread cache, so simple_aligned_alloc takes them from
+ * there again. With SIMPLE_MALLOC_ALIGNMENT=8 in the environment requests go
+ * straight to simple_malloc; most programs do not depend on the larger
+ * alignment.
+ *
+ * A request made while the allocator is already busy on the same thread, as
+ * when something it calls allocates in turn, is served from a static buffer
+ * that is never given back. The library is built with -DMM_QUIET and
+ * initial-exec TLS, so neither the set up messages nor the first use of a
+ * thread local variable allocate.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mm.h"
+
+#define PRELOAD_ALIGNMENT  (16)             // What the C library guarantees on 64 bit targets
+#define PRELOAD_ALIGN_ENV  "SIMPLE_MALLOC_ALIGNMENT"
+#define BOOTSTRAP_SIZE     (64 * 1024)
+
+static _Thread_local int busy;             // Inside the allocator on this thread
+static size_t min_alignment;                // 0 until read from the environment
+
+/* Requests made while busy, each preceded by its size */
+static uint8_t bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(PRELOAD_ALIGNMENT)));
+static size_t bootstrap_used;
+
+// Serves a request while the allocator is busy on this thread
+static void *bootstrap_malloc(size_t size) {
+    if (size > BOOTSTRAP_SIZE) return NULL;
+
+    size_t total = PRELOAD_ALIGNMENT + ((size + PRELOAD_ALIGNMENT - 1) & ~(size_t)(PRELOAD_ALIGNMENT - 1));
+    size_t offset = __atomic_fetch_add(&bootstrap_used, total, __ATOMIC_RELAXED);
+    if (offset + total > BOOTSTRAP_SIZE) return NULL;
+
+    *(size_t *)(bootstrap + offset) = size;
+    return bootstrap + offset + PRELOAD_ALIGNMENT;
+}
+
+static int is_bootstrap(void *ptr) {
+    return (uint8_t *)ptr >= bootstrap && (uint8_t *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t bootstrap_size(void *ptr) {
+    return *(size_t *)((uint8_t *)ptr - PRELOAD_ALIGNMENT);
+}
+
+// Gets the alignment every block gets, read from the environment on first use
+static size_t preload_alignment(void) {
+    if (min_alignment == 0) {
+        const char *env = getenv(PRELOAD_ALIGN_ENV);
+        min_alignment = env != NULL && strcmp(env, "8") == 0 ? sizeof(void *) : PRELOAD_ALIGNMENT;
+    }
+    return min_alignment;
+}
+
+// Allocates a block of at least the given alignment. Caller is busy.
+static void *preload_malloc(size_t alignment, size_t size) {
+    size_t align = preload_alignment();
+
+    if (alignment < align && size > sizeof(void *)) alignment = align;  // Smaller blocks hold no wider type
+    if (alignment <= sizeof(void *)) return simple_malloc(size);
+    return simple_aligned_alloc(alignment, size);
+}
+
+void *malloc(size_t size) {
+    void *ptr;
+
+    if (busy) return bootstrap_malloc(size);
+    busy = 1;
+    ptr = preload_malloc(sizeof(void *), size);
+    busy = 0;
+    if (ptr == NULL) errno = ENOMEM;
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || is_bootstrap(ptr)) return;
+
+    int was_busy = busy;
+    busy = 1;
+    simple_free(ptr);
+    busy = was_busy;
+}
+
+void *calloc(size_t count, size_t size) {
+    size_t total;
+    void *ptr;
+
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (busy) {
+        // The static buffer is zero where it was never handed out
+        return bootstrap_malloc(total);
+    }
+
+    busy = 1;
+    if (preload_alignment() <= sizeof(void *) || total <= sizeof(void *)) {
+        ptr = simple_calloc(count, size);
+    } else {
+        ptr = simple_aligned_alloc(preload_alignment(), total);
+        if (ptr != NULL) memset(ptr, 0, total);
+    }
+    busy = 0;
+    if (ptr == NULL) errno = ENOMEM;
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    void *result;
+
+    if (ptr == NULL) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    if (is_bootstrap(ptr)) {
+        size_t old_size = bootstrap_size(ptr);
+        result = malloc(size);
+        if (result != NULL) memcpy(result, ptr, old_size < size ? old_size : size);
+        return result;
+    }
+    if (busy) return NULL;
+
+    busy = 1;
+    result = simple_realloc(ptr, size);
+
+    // Moved blocks come from simple_malloc, which only aligns to a word. If no
+    // aligned block can be had the moved one still holds the data.
+    size_t align = preload_alignment();
+    if (result != NULL && size > sizeof(void *) && ((uintptr_t)result & (align - 1)) != 0) {
+        void *aligned = simple_aligned_alloc(align, size);
+        if (aligned != NULL) {
+            memcpy(aligned, result, size);
+            simple_free(result);
+            result = aligned;
+        }
+    }
+    busy = 0;
+    if (result == NULL) errno = ENOMEM;
+    return result;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0) return EINVAL;
+    if (busy) return ENOMEM;
+
+    busy = 1;
+    void *ptr = preload_malloc(alignment, size);
+    busy = 0;
+    if (ptr == NULL) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    void *ptr = NULL;
+
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!busy) {
+        busy = 1;
+        ptr = preload_malloc(alignment, size);
+        busy = 0;
+    }
+    if (ptr == NULL) errno = ENOMEM;
+    return ptr;
+}
+
+void *memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size) {
+    return aligned_alloc((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr) {
+    if (ptr != NULL && is_bootstrap(ptr)) return bootstrap_size(ptr);
+    return simple_usable_size(ptr);
+}
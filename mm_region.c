@@ -0,0 +1,106 @@
+/**
+ * @file   mm_region.c
+ * @brief  Regions: bump pointer allocation out of chunks from simple_malloc,
+ *         released all at once.
+ *
+ * Objects have no header and are never freed one by one. A region is meant
+ * to be used by one thread at a time, so it takes no lock.
+ */
+
+#include <stdint.h>
+#include "mm.h"
+
+#define REGION_CHUNK_SIZE (64 * 1024)        // Bytes in the first chunk
+#define REGION_CHUNK_MAX  (1024 * 1024)      // Chunks double up to this size
+
+/* Chunks of a region, newest first. The largest one is kept by a reset. */
+typedef struct Chunk {
+    struct Chunk *next;
+    size_t size;            // Including this header
+} Chunk;
+
+struct SimpleRegion {
+    Chunk *chunks;
+    uint8_t *bump;          // Next free byte in the newest chunk
+    uint8_t *bump_end;
+};
+
+SimpleRegion *simple_region_create(void) {
+    SimpleRegion *region = simple_malloc(sizeof(SimpleRegion));
+    if (region == NULL) return NULL;
+
+    region->chunks = NULL;
+    region->bump = NULL;
+    region->bump_end = NULL;
+    return region;
+}
+
+// Adds a chunk with room for at least size bytes to the region
+static int region_grow(SimpleRegion *region, size_t size) {
+    size_t chunk_size = region->chunks == NULL ? REGION_CHUNK_SIZE : 2 * region->chunks->size;
+
+    if (chunk_size > REGION_CHUNK_MAX) chunk_size = REGION_CHUNK_MAX;
+    if (chunk_size < sizeof(Chunk) + size) chunk_size = sizeof(Chunk) + size;
+
+    Chunk *chunk = simple_malloc(chunk_size);
+    if (chunk == NULL) return 0;
+
+    chunk->next = region->chunks;
+    chunk->size = chunk_size;
+    region->chunks = chunk;
+    region->bump = (uint8_t *)(chunk + 1);
+    region->bump_end = (uint8_t *)chunk + chunk_size;
+    return 1;
+}
+
+void *simple_region_alloc(SimpleRegion *region, size_t size) {
+    if (size > SIZE_MAX / 4) return NULL;  // Also guards the rounding below
+
+    size_t aligned_size = (size + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1);
+    if (aligned_size == 0) aligned_size = sizeof(void *);  // Every object gets an address of its own
+
+    if ((size_t)(region->bump_end - region->bump) < aligned_size && !region_grow(region, aligned_size)) {
+        return NULL;
+    }
+
+    void *result = region->bump;
+    region->bump += aligned_size;
+    return result;
+}
+
+void simple_region_reset(SimpleRegion *region) {
+    Chunk *keep = NULL;
+    Chunk *chunk;
+
+    // Keep the largest chunk, likely to hold a whole request, unless it was
+    // grown beyond REGION_CHUNK_MAX for one large object
+    for (chunk = region->chunks; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size <= REGION_CHUNK_MAX && (keep == NULL || chunk->size > keep->size)) keep = chunk;
+    }
+    while (region->chunks != NULL) {
+        chunk = region->chunks;
+        region->chunks = chunk->next;
+        if (chunk != keep) simple_free(chunk);
+    }
+
+    region->chunks = keep;
+    if (keep == NULL) {
+        region->bump = NULL;
+        region->bump_end = NULL;
+        return;
+    }
+    keep->next = NULL;
+    region->bump = (uint8_t *)(keep + 1);
+    region->bump_end = (uint8_t *)keep + keep->size;
+}
+
+void simple_region_destroy(SimpleRegion *region) {
+    if (region == NULL) return;
+
+    while (region->chunks != NULL) {
+        Chunk *chunk = region->chunks;
+        region->chunks = chunk->next;
+        simple_free(chunk);
+    }
+    simple_free(region);
+}